@@ -24,12 +24,27 @@
  *
  * For more information, please refer to <http://unlicense.org/>
  */
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iterator>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "SQLiteVfs.h"
@@ -41,8 +56,92 @@
 	#define DISK_SECTOR_SIZE 32
 #endif
 
-/// Indexed DB key used to store idbvfs file sizes
+/// Maximum number of page files each idbvfs file keeps open at once
+#ifndef IDBVFS_MAX_OPEN_PAGES
+	#define IDBVFS_MAX_OPEN_PAGES 32
+#endif
+
+/// Maximum number of database pages each idbvfs file keeps in memory, 0 disables the page cache
+#ifndef IDBVFS_CACHE_PAGES
+	#define IDBVFS_CACHE_PAGES 256
+#endif
+
+/// Bytes that the page caches of all idbvfs files may hold together, 0 disables the limit.
+/// Can be changed at runtime with `idbvfs_cache_budget`.
+#ifndef IDBVFS_CACHE_BUDGET
+	#define IDBVFS_CACHE_BUDGET (8 * 1024 * 1024)
+#endif
+
+/// Number of pages loaded into the page cache after sequential reads, 0 disables read-ahead
+#ifndef IDBVFS_READ_AHEAD_PAGES
+	#define IDBVFS_READ_AHEAD_PAGES 8
+#endif
+
+/// Number of whole pages that must be read in order before reading ahead
+#ifndef IDBVFS_READ_AHEAD_MIN_SEQUENTIAL_READS
+	#define IDBVFS_READ_AHEAD_MIN_SEQUENTIAL_READS 2
+#endif
+
+/// Maximum size of databases opened with the "preload" URI parameter that get loaded into the page cache, 0 disables the limit.
+/// Their page cache grows past `IDBVFS_CACHE_PAGES` to fit them.
+/// Can be changed per database with the "preload_max_size" URI parameter.
+#ifndef IDBVFS_PRELOAD_MAX_SIZE
+	#define IDBVFS_PRELOAD_MAX_SIZE (4 * 1024 * 1024)
+#endif
+
+/// Size of the pages new databases are stored in, 0 uses the size of the first page SQLite writes
+#ifndef IDBVFS_PAGE_SIZE
+	#define IDBVFS_PAGE_SIZE 0
+#endif
+
+/// Number of consecutive pages stored in each page file of new databases, 1 stores one file per page
+#ifndef IDBVFS_EXTENT_PAGES
+	#define IDBVFS_EXTENT_PAGES 1
+#endif
+
+/// Whether new databases compress their pages
+#ifndef IDBVFS_COMPRESS
+	#define IDBVFS_COMPRESS 0
+#endif
+
+/// Whether new databases store a checksum with each page
+#ifndef IDBVFS_CHECKSUMS
+	#define IDBVFS_CHECKSUMS 0
+#endif
+
+/// Whether new databases store their page files in subdirectories instead of all of them in the database directory
+#ifndef IDBVFS_FANOUT_DIRECTORIES
+	#define IDBVFS_FANOUT_DIRECTORIES 0
+#endif
+
+/// Verify the checksum of 1 in every N page reads, 1 verifies every read and 0 disables verification
+#ifndef IDBVFS_CHECKSUM_SAMPLING
+	#define IDBVFS_CHECKSUM_SAMPLING 1
+#endif
+
+/// Size of each page file used to store journals
+#ifndef IDBVFS_JOURNAL_CHUNK_SIZE
+	#define IDBVFS_JOURNAL_CHUNK_SIZE (64 * 1024)
+#endif
+
+/// Delay used by the debounced sync policy when none is specified, in milliseconds
+#ifndef IDBVFS_SYNC_DELAY_MS
+	#define IDBVFS_SYNC_DELAY_MS 1000
+#endif
+
+/// Number of events kept by the tracer until they are drained
+#ifndef IDBVFS_TRACE_EVENTS
+	#define IDBVFS_TRACE_EVENTS 4096
+#endif
+
+/// Indexed DB key used to store idbvfs file headers, named after the legacy text file size
 #define IDBVFS_SIZE_KEY "file_size"
+/// Indexed DB key where snapshots store the name of the database they were taken from
+#define IDBVFS_SNAPSHOT_OF_KEY "snapshot_of"
+/// Indexed DB key where databases list their snapshots, one per line
+#define IDBVFS_SNAPSHOTS_KEY "snapshots"
+/// Indexed DB key where databases store the pages of a batch atomic write before storing them in their page files
+#define IDBVFS_BATCH_KEY "batch"
 
 
 #ifdef __EMSCRIPTEN__
@@ -53,24 +152,22 @@
 #endif
 
 
-#ifdef TRACE
-static void TRACE_LOG(const char *fmt, ...) {
-	va_list args;
-	va_start(args, fmt);
-	static char _idbvfs_trace_log_buffer[1024];
-	vsnprintf(_idbvfs_trace_log_buffer, sizeof(_idbvfs_trace_log_buffer), fmt, args);
-#ifdef __EMSCRIPTEN__
-	EM_ASM({ console.log(UTF8ToString($0)) }, _idbvfs_trace_log_buffer);
-#else
-	printf("%s\n", _idbvfs_trace_log_buffer);
-#endif
-	va_end(args);
+using namespace sqlitevfs;
+
+static uint64_t read_le(const uint8_t *data, int size) {
+	uint64_t value = 0;
+	for (int i = size - 1; i >= 0; i--) {
+		value = (value << 8) | data[i];
+	}
+	return value;
 }
-#else
-	#define TRACE_LOG(...)
-#endif
 
-using namespace sqlitevfs;
+static void write_le(uint8_t *out, uint64_t value, int size) {
+	for (int i = 0; i < size; i++) {
+		out[i] = value & 0xff;
+		value >>= 8;
+	}
+}
 
 class IdbPage {
 public:
@@ -90,42 +187,28 @@ public:
 	}
 
 	bool exists() const {
-		if (FILE *f = fopen(filename.c_str(), "r")) {
-			fclose(f);
-			return true;
-		}
-		else {
-			return false;
-		}
+		return access(filename.c_str(), F_OK) == 0;
 	}
 
-	int load_into(void *data, size_t data_size, sqlite3_int64 offset_in_page = 0) const {
+	int scan_into(const char *fmt, ...) const {
 		if (FILE *f = fopen(filename.c_str(), "r")) {
-			if (offset_in_page > 0) {
-				fseek(f, offset_in_page, SEEK_SET);
-			}
-			size_t read_bytes = fread(data, 1, data_size, f);
+			va_list args;
+			va_start(args, fmt);
+			int assigned_items = vfscanf(f, fmt, args);
+			va_end(args);
 			fclose(f);
-			return read_bytes;
+			return assigned_items;
 		}
 		else {
 			return 0;
 		}
 	}
 
-	int load_into(std::vector<uint8_t>& out_buffer, size_t data_size) const {
-		out_buffer.resize(data_size);
-		return load_into(out_buffer.data(), data_size);
-	}
-
-	int scan_into(const char *fmt, ...) const {
+	int load_into(void *data, size_t data_size) const {
 		if (FILE *f = fopen(filename.c_str(), "r")) {
-			va_list args;
-			va_start(args, fmt);
-			int assigned_items = vfscanf(f, fmt, args);
-			va_end(args);
+			size_t read_bytes = fread(data, 1, data_size, f);
 			fclose(f);
-			return assigned_items;
+			return read_bytes;
 		}
 		else {
 			return 0;
@@ -145,14 +228,23 @@ public:
 		}
 	}
 
-	int store(const std::vector<uint8_t>& data) const {
-		return store(data.data(), data.size());
-	}
-
 	int store(const std::string& data) const {
 		return store(data.c_str(), data.size());
 	}
 
+	std::string load_text() const {
+		std::string text;
+		if (FILE *f = fopen(filename.c_str(), "r")) {
+			char buffer[256];
+			size_t read_bytes;
+			while ((read_bytes = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+				text.append(buffer, read_bytes);
+			}
+			fclose(f);
+		}
+		return text;
+	}
+
 	bool remove() const {
 		return unlink(filename.c_str()) == 0;
 	}
@@ -162,288 +254,3323 @@ private:
 	std::string filename;
 };
 
-struct IdbFileSize : public IdbPage {
-	IdbFileSize() : IdbPage() {}
-	IdbFileSize(sqlite3_filename file_name, bool autoload = true) : IdbPage(file_name, IDBVFS_SIZE_KEY) {
-		if (autoload) {
-			load();
+/**
+ * Bounded LRU cache of open page file descriptors.
+ *
+ * Page files are named "<dbname>/<file_number>" and hold either a single
+ * page or an extent of consecutive pages.
+ * In the fan-out layout they are named "<dbname>/<file_number / 256>/<file_number % 256>"
+ * instead, so that each subdirectory holds at most 256 page files.
+ * The database directory still grows with the database, but by one
+ * subdirectory per 256 page files instead of one entry per page file.
+ * Paths are built in place over a precomputed "<dbname>/" prefix and data
+ * is accessed with a single `pread`/`pwrite` call, so reading or writing a
+ * recently used page file never touches the file system namespace.
+ *
+ * Copy-on-write snapshots start without page files of their own and read
+ * the ones they miss from their bases, the databases they were taken from.
+ * Page files are copied into a snapshot before either side changes them:
+ * snapshots copy them from their base before writing, and bases copy them
+ * into each of their snapshots before overwriting or removing them.
+ * Empty page files hide the base's ones, for pages removed on either side.
+ */
+class IdbPageHandles {
+public:
+	static constexpr int FANOUT_FILES = 256;
+
+	IdbPageHandles() {}
+
+	IdbPageHandles(const char *dbname, bool is_fanout = false, size_t max_open = IDBVFS_MAX_OPEN_PAGES)
+		: dbname(dbname)
+		, path(dbname)
+		, is_fanout(is_fanout)
+		, max_open(max_open > 0 ? max_open : 1)
+	{
+		path.append("/");
+		prefix_length = path.size();
+	}
+
+	int load_into(int file_number, void *data, size_t data_size, sqlite3_int64 offset = 0) {
+		int fd = acquire(file_number, false);
+		if (fd < 0) {
+			return bases.empty() ? 0 : load_from_base(file_number, data, data_size, offset);
 		}
+		ssize_t read_bytes = pread(fd, data, data_size, offset);
+		return read_bytes > 0 ? read_bytes : 0;
 	}
 
-	void load() {
-		scan_into("%lu", &file_size);
-		is_dirty = false;
+	int load_into(int file_number, std::vector<uint8_t>& out_buffer, size_t data_size) {
+		out_buffer.resize(data_size);
+		return load_into(file_number, out_buffer.data(), data_size);
 	}
 
-	size_t get() const {
-		return file_size;
+	int store(int file_number, const void *data, size_t data_size, sqlite3_int64 offset = 0, bool truncate = false) {
+		if (!prepare_change(file_number)) {
+			return 0;
+		}
+		int fd = acquire(file_number, true);
+		if (fd < 0) {
+			return 0;
+		}
+		ssize_t written_bytes = pwrite(fd, data, data_size, offset);
+		if (truncate && written_bytes == (ssize_t) data_size && ftruncate(fd, offset + data_size) != 0) {
+			return 0;
+		}
+		return written_bytes > 0 ? written_bytes : 0;
 	}
 
-	void set(size_t new_file_size) {
-		if (new_file_size != file_size) {
-			file_size = new_file_size;
-			is_dirty = true;
+	int store(int file_number, const std::vector<uint8_t>& data, bool truncate = false) {
+		return store(file_number, data.data(), data.size(), 0, truncate);
+	}
+
+	sqlite3_int64 stored_size(int file_number) {
+		struct stat file_stat;
+		int fd = acquire(file_number, false);
+		if (fd < 0 && !bases.empty()) {
+			int base_fd = open_base_file(file_number);
+			sqlite3_int64 size = base_fd >= 0 && fstat(base_fd, &file_stat) == 0 ? file_stat.st_size : 0;
+			if (base_fd >= 0) {
+				close(base_fd);
+			}
+			return size;
 		}
+		return fd >= 0 && fstat(fd, &file_stat) == 0 ? file_stat.st_size : 0;
 	}
 
-	void update_if_greater(size_t new_file_size) {
-		if (new_file_size > file_size) {
-			set(new_file_size);
+	bool truncate(int file_number, sqlite3_int64 size) {
+		if (!prepare_change(file_number)) {
+			return false;
 		}
+		int fd = acquire(file_number, false);
+		return fd >= 0 && ftruncate(fd, size) == 0;
 	}
 
-	bool sync() const {
-		if (is_dirty) {
-			return store(std::to_string(file_size)) > 0;
+	/// Remove a page file, closing its handle first.
+	/// Files that don't exist are considered removed.
+	/// In the fan-out layout, its subdirectory is also removed once empty.
+	bool remove(int file_number) {
+		if (!snapshots.empty() && !preserve(file_number)) {
+			return false;
 		}
-		else {
-			return true;
+		auto it = handles.find(file_number);
+		if (it != handles.end()) {
+			close(it->second->second);
+			lru.erase(it->second);
+			handles.erase(it);
+		}
+		if (!bases.empty()) {
+			int base_fd = open_base_file(file_number);
+			if (base_fd >= 0) {
+				close(base_fd);
+				// hide the base's page file
+				std::lock_guard<std::mutex> lock(snapshot_mutex);
+				return write_file(dbname, file_number, std::vector<uint8_t>(), false);
+			}
+		}
+		bool removed = unlink(file_path(file_number)) == 0 || errno == ENOENT;
+		if (is_fanout) {
+			rmdir(directory_path(file_number));
 		}
+		return removed;
 	}
 
-private:
-	size_t file_size = 0;
-	bool is_dirty = false;
-};
+	void close_all() {
+		for (auto& handle : lru) {
+			close(handle.second);
+		}
+		lru.clear();
+		handles.clear();
+	}
 
-struct IdbFile : public SQLiteFileImpl {
-	sqlite3_filename file_name;
-	IdbFileSize file_size;
-	std::vector<uint8_t> journal_data;
-	bool is_db;
+	/// Databases that page files missing from this one are read from, nearest first
+	void set_bases(std::vector<std::string> new_bases) {
+		bases = std::move(new_bases);
+	}
 
-	IdbFile() {}
-	IdbFile(sqlite3_filename file_name, bool is_db) : file_name(file_name), file_size(file_name), is_db(is_db) {}
+	/// Snapshots that may still share page files with this database
+	void set_snapshots(const std::vector<std::string>& names) {
+		snapshots.clear();
+		for (const std::string& name : names) {
+			add_snapshot(name);
+		}
+	}
 
-	int iVersion() const override {
-		return 1;
+	void add_snapshot(const std::string& name) {
+		snapshots.push_back(Snapshot { name, {} });
 	}
 
-	int xClose() override {
-		return SQLITE_OK;
+	void remove_snapshot(const std::string& name) {
+		snapshots.erase(std::remove_if(snapshots.begin(), snapshots.end(), [&](const Snapshot& snapshot) {
+			return snapshot.name == name;
+		}), snapshots.end());
 	}
 
-	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
-		TRACE_LOG("READ %s %d @ %ld", file_name, iAmt, iOfst);
-		if (iAmt + iOfst > file_size.get()) {
-			TRACE_LOG("  > %d", false);
-			return SQLITE_IOERR_SHORT_READ;
+	/// Copy a page file into every snapshot that still shares it.
+	/// Snapshots get an empty file if it doesn't exist, so that they don't see it once it's created.
+	bool preserve(int file_number) {
+		std::vector<uint8_t> data;
+		bool is_loaded = false;
+		for (Snapshot& snapshot : snapshots) {
+			if (snapshot.preserved_files.count(file_number)) {
+				continue;
+			}
+			std::lock_guard<std::mutex> lock(snapshot_mutex);
+			if (access(other_file_path(snapshot.name, file_number).c_str(), F_OK) != 0) {
+				if (!is_loaded && !load_whole(file_number, data)) {
+					return false;
+				}
+				is_loaded = true;
+				if (!write_file(snapshot.name, file_number, data, true)) {
+					return false;
+				}
+			}
+			snapshot.preserved_files.insert(file_number);
 		}
+		return true;
+	}
 
-		int result;
-		if (is_db) {
-			result = readDb(p, iAmt, iOfst);
-		}
-		else {
-			result = readJournal(p, iAmt, iOfst);
-		}
-		TRACE_LOG("  > %d", result);
-		return result;
+private:
+	using LruList = std::list<std::pair<int, int>>;
+
+	struct Snapshot {
+		std::string name;
+		/// Page files known to be in the snapshot already
+		std::set<int> preserved_files;
+	};
+
+	// Page files shared with snapshots or bases must be copied before they change
+	bool prepare_change(int file_number) {
+		return (snapshots.empty() || preserve(file_number))
+			&& (bases.empty() || copy_from_base(file_number));
 	}
 
-	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
-		TRACE_LOG("WRITE %s %d @ %ld", file_name, iAmt, iOfst);
-		int result;
-		if (is_db) {
-			result = writeDb(p, iAmt, iOfst);
+	bool copy_from_base(int file_number) {
+		if (handles.count(file_number)) {
+			return true;
 		}
-		else {
-			result = writeJournal(p, iAmt, iOfst);
+		std::lock_guard<std::mutex> lock(snapshot_mutex);
+		if (access(file_path(file_number), F_OK) == 0) {
+			return true;
+		}
+		int base_fd = open_base_file(file_number);
+		if (base_fd < 0) {
+			return true;
 		}
-		TRACE_LOG("  > %d", result);
-		return result;
+		std::vector<uint8_t> data;
+		bool success = read_all(base_fd, data);
+		close(base_fd);
+		return success && write_file(dbname, file_number, data, true);
 	}
 
-	int xTruncate(sqlite3_int64 size) override {
-		TRACE_LOG("TRUNCATE %s to %ld", file_name, size);
-		file_size.set(size);
-		TRACE_LOG("  > %d", true);
-		return SQLITE_OK;
+	// Handles of base page files are never kept open, since bases may change
+	// them right after copying them into this snapshot.
+	int open_base_file(int file_number) const {
+		for (const std::string& base : bases) {
+			int fd = open(other_file_path(base, file_number).c_str(), O_RDONLY);
+			if (fd >= 0 || errno != ENOENT) {
+				return fd;
+			}
+		}
+		return -1;
 	}
 
-	int xSync(int flags) override {
-		TRACE_LOG("SYNC %s %d", file_name, flags);
-		// journal data is stored in-memory and synced all at once
-		if (!journal_data.empty()) {
-			IdbPage file(file_name, 0);
-			file.store(journal_data);
-			file_size.set(journal_data.size());
-		}
-		bool success = file_size.sync();
-		INLINE_JS({
-			Module.idbvfsSyncfs();
-		});
-		TRACE_LOG("  > %d", success);
-		return success ? SQLITE_OK : SQLITE_IOERR_FSYNC;
+	int load_from_base(int file_number, void *data, size_t data_size, sqlite3_int64 offset) const {
+		int fd = open_base_file(file_number);
+		if (fd < 0) {
+			return 0;
+		}
+		ssize_t read_bytes = pread(fd, data, data_size, offset);
+		close(fd);
+		return read_bytes > 0 ? read_bytes : 0;
 	}
 
-	int xFileSize(sqlite3_int64 *pSize) override {
-		TRACE_LOG("FILE SIZE %s", file_name);
-		if (!journal_data.empty()) {
-			*pSize = journal_data.size();
+	// Load a whole page file as this database sees it, empty if it doesn't exist
+	bool load_whole(int file_number, std::vector<uint8_t>& data) {
+		data.clear();
+		int fd = acquire(file_number, false);
+		if (fd >= 0) {
+			return read_all(fd, data);
 		}
-		else {
-			*pSize = file_size.get();
+		int base_fd = open_base_file(file_number);
+		if (base_fd < 0) {
+			return true;
 		}
-		TRACE_LOG("  > %d", *pSize);
-		return SQLITE_OK;
+		bool success = read_all(base_fd, data);
+		close(base_fd);
+		return success;
 	}
 
-	int xLock(int flags) override {
-		return SQLITE_OK;
+	static bool read_all(int fd, std::vector<uint8_t>& data) {
+		struct stat file_stat;
+		if (fstat(fd, &file_stat) != 0) {
+			return false;
+		}
+		data.resize(file_stat.st_size);
+		return data.empty() || pread(fd, data.data(), data.size(), 0) == (ssize_t) data.size();
 	}
 
-	int xUnlock(int flags) override {
-		return SQLITE_OK;
+	// Write a whole page file of a database with the same layout.
+	// Exclusive writes succeed without writing if the file already exists.
+	bool write_file(const std::string& other_dbname, int file_number, const std::vector<uint8_t>& data, bool exclusive) const {
+		std::string filename = other_file_path(other_dbname, file_number);
+		int flags = O_WRONLY | O_CREAT | (exclusive ? O_EXCL : O_TRUNC);
+		int fd = open(filename.c_str(), flags, 0666);
+		if (fd < 0 && errno == ENOENT) {
+			mkdir(other_dbname.c_str(), 0777);
+			if (is_fanout) {
+				mkdir((other_dbname + "/" + std::to_string(file_number / FANOUT_FILES)).c_str(), 0777);
+			}
+			fd = open(filename.c_str(), flags, 0666);
+		}
+		if (fd < 0) {
+			return exclusive && errno == EEXIST;
+		}
+		bool success = data.empty() || pwrite(fd, data.data(), data.size(), 0) == (ssize_t) data.size();
+		close(fd);
+		return success;
 	}
 
-	int xCheckReservedLock(int *pResOut) override {
-		*pResOut = 0;
-		return SQLITE_OK;
+	int format_file_name(char *out, size_t out_size, int file_number) const {
+		return is_fanout
+			? snprintf(out, out_size, "%d/%d", file_number / FANOUT_FILES, file_number % FANOUT_FILES)
+			: snprintf(out, out_size, "%d", file_number);
 	}
 
-	int xFileControl(int op, void *pArg) override {
-		switch (op) {
-			case SQLITE_FCNTL_VFSNAME:
-				*(char **) pArg = sqlite3_mprintf("%z", IDBVFS_NAME);
-				return SQLITE_OK;
-		}
-		return SQLITE_NOTFOUND;
+	std::string other_file_path(const std::string& other_dbname, int file_number) const {
+		char name[32];
+		format_file_name(name, sizeof(name), file_number);
+		return other_dbname + "/" + name;
 	}
 
-	int xSectorSize() override {
-		return DISK_SECTOR_SIZE;
+	const char *file_path(int file_number) {
+		char name[32];
+		int length = format_file_name(name, sizeof(name), file_number);
+		path.replace(prefix_length, std::string::npos, name, length);
+		return path.c_str();
 	}
 
-	int xDeviceCharacteristics() override {
-		return 0;
+	const char *directory_path(int file_number) {
+		char number[16];
+		int length = snprintf(number, sizeof(number), "%d", file_number / FANOUT_FILES);
+		path.replace(prefix_length, std::string::npos, number, length);
+		return path.c_str();
 	}
 
-private:
-	int readDb(void *p, int iAmt, sqlite3_int64 iOfst) {
-		int page_number;
-		sqlite3_int64 offset_in_page;
-		if (iOfst + iAmt >= 512) {
-			if (iOfst % iAmt != 0) {
-				return SQLITE_IOERR_READ;
-			}
-			page_number = iOfst / iAmt;
-			offset_in_page = 0;
-		} else {
-			page_number = 0;
-			offset_in_page = iOfst;
+	int acquire(int file_number, bool create) {
+		auto it = handles.find(file_number);
+		if (it != handles.end()) {
+			lru.splice(lru.begin(), lru, it->second);
+			return it->second->second;
 		}
 
-		IdbPage page(file_name, page_number);
-		int loaded_bytes = page.load_into((uint8_t*) p, iAmt, offset_in_page);
-		if (loaded_bytes < iAmt) {
-			return SQLITE_IOERR_SHORT_READ;
+		const char *filename = file_path(file_number);
+		int fd = open(filename, O_RDWR);
+		if (fd < 0 && errno == ENOENT && create) {
+			mkdir(dbname, 0777);
+			if (is_fanout) {
+				mkdir(directory_path(file_number), 0777);
+				filename = file_path(file_number);
+			}
+			fd = open(filename, O_RDWR | O_CREAT, 0666);
 		}
-		else {
-			return SQLITE_OK;
+		else if (fd < 0 && errno == EACCES && !create) {
+			fd = open(filename, O_RDONLY);
+		}
+		if (fd < 0) {
+			return fd;
 		}
+
+		if (lru.size() >= max_open) {
+			close(lru.back().second);
+			handles.erase(lru.back().first);
+			lru.pop_back();
+		}
+		lru.emplace_front(file_number, fd);
+		handles[file_number] = lru.begin();
+		return fd;
 	}
 
-	int readJournal(void *p, int iAmt, sqlite3_int64 iOfst) {
-		if (journal_data.empty()) {
-			size_t journal_size = file_size.get();
-			if (journal_size > 0) {
-				IdbPage page(file_name, 0);
-				page.load_into(journal_data, journal_size);
+	const char *dbname;
+	std::string path;
+	size_t prefix_length;
+	bool is_fanout = false;
+	size_t max_open;
+	/// Open handles as (file_number, fd) pairs, most recently used first
+	LruList lru;
+	std::unordered_map<int, LruList::iterator> handles;
+	std::vector<std::string> bases;
+	std::vector<Snapshot> snapshots;
+	/// Serializes copying page files between snapshots and their bases
+	static std::mutex snapshot_mutex;
+};
+
+std::mutex IdbPageHandles::snapshot_mutex;
+
+/**
+ * Small LZ77 codec for database pages, using the LZ4 block format.
+ *
+ * Sequences are a token with literal and match lengths, extra length bytes,
+ * literals, then a 2-byte little-endian match offset, except for the last
+ * sequence, which only has literals.
+ * Like LZ4, matches start at least 12 bytes before the end of the block and
+ * the last 5 bytes are always literals, so standard decoders accept the output.
+ */
+class IdbCompression {
+public:
+	/// @return Compressed size, or 0 if the data doesn't fit in `dst_capacity` bytes.
+	static int compress(const uint8_t *src, int src_size, uint8_t *dst, int dst_capacity) {
+		int table[1 << HASH_BITS] = {};
+		int ip = 0;
+		int anchor = 0;
+		int op = 0;
+		while (ip + MATCH_START_LIMIT <= src_size) {
+			uint32_t sequence = read_le(src + ip, 4);
+			uint32_t hash = (sequence * 2654435761u) >> (32 - HASH_BITS);
+			int ref = table[hash] - 1;
+			table[hash] = ip + 1;
+			if (ref < 0 || ip - ref > 0xffff || read_le(src + ref, 4) != sequence) {
+				ip++;
+				continue;
+			}
+			int match_length = MIN_MATCH;
+			while (ip + match_length < src_size - LAST_LITERALS && src[ref + match_length] == src[ip + match_length]) {
+				match_length++;
+			}
+			op = write_sequence(src + anchor, ip - anchor, ip - ref, match_length, dst, op, dst_capacity);
+			if (op < 0) {
+				return 0;
 			}
+			ip += match_length;
+			anchor = ip;
 		}
-		if (iAmt + iOfst > journal_data.size()) {
-			return SQLITE_IOERR_SHORT_READ;
+		if (anchor < src_size || op == 0) {
+			op = write_sequence(src + anchor, src_size - anchor, 0, 0, dst, op, dst_capacity);
 		}
-		memcpy(p, journal_data.data() + iOfst, iAmt);
-		return SQLITE_OK;
+		return op > 0 ? op : 0;
 	}
 
-	int writeDb(const void *p, int iAmt, sqlite3_int64 iOfst) {
-		int page_number = iOfst ? iOfst / iAmt : 0;
+	/// @return Decompressed size, or -1 if the data is malformed or doesn't fit in `dst_capacity` bytes.
+	static int decompress(const uint8_t *src, int src_size, uint8_t *dst, int dst_capacity) {
+		int ip = 0;
+		int op = 0;
+		while (ip < src_size) {
+			int token = src[ip++];
+			int literal_length = read_length(token >> 4, src, src_size, ip);
+			if (literal_length < 0 || literal_length > src_size - ip || literal_length > dst_capacity - op) {
+				return -1;
+			}
+			memcpy(dst + op, src + ip, literal_length);
+			ip += literal_length;
+			op += literal_length;
+			if (ip == src_size) {
+				break;
+			}
 
-		IdbPage page(file_name, page_number);
-		int stored_bytes = page.store(p, iAmt);
-		if (stored_bytes < iAmt) {
-			return SQLITE_IOERR_WRITE;
+			if (src_size - ip < 2) {
+				return -1;
+			}
+			int offset = read_le(src + ip, 2);
+			ip += 2;
+			int match_length = read_length(token & 15, src, src_size, ip);
+			if (offset == 0 || offset > op || match_length < 0 || match_length + MIN_MATCH > dst_capacity - op) {
+				return -1;
+			}
+			match_length += MIN_MATCH;
+			// byte by byte, since matches may overlap the data they produce
+			for (int i = 0; i < match_length; i++, op++) {
+				dst[op] = dst[op - offset];
+			}
 		}
-
-		file_size.update_if_greater(iAmt + iOfst);
-		return SQLITE_OK;
+		return op;
 	}
 
-	int writeJournal(const void *p, int iAmt, sqlite3_int64 iOfst) {
-		if (iAmt + iOfst > journal_data.size()) {
-			journal_data.resize(iAmt + iOfst);
+private:
+	static constexpr int MIN_MATCH = 4;
+	static constexpr int HASH_BITS = 12;
+	/// Matches must start at least this many bytes before the end of the block
+	static constexpr int MATCH_START_LIMIT = 12;
+	/// The last bytes of the block are always literals
+	static constexpr int LAST_LITERALS = 5;
+
+	static int write_length(int length, uint8_t *dst, int op, int dst_capacity) {
+		for (length -= 15; length >= 0; length -= 255) {
+			if (op >= dst_capacity) {
+				return -1;
+			}
+			dst[op++] = length >= 255 ? 255 : length;
 		}
-		memcpy(journal_data.data() + iOfst, p, iAmt);
-		return SQLITE_OK;
+		return op;
 	}
-};
 
-struct IdbVfs : public SQLiteVfsImpl<IdbFile> {
-	int xOpen(sqlite3_filename zName, SQLiteFile<IdbFile> *file, int flags, int *pOutFlags) override {
-		TRACE_LOG("OPEN %s", zName);
-		bool is_db = (flags & SQLITE_OPEN_MAIN_DB) || (flags & SQLITE_OPEN_TEMP_DB);
-		file->implementation = IdbFile(zName, is_db);
-		return SQLITE_OK;
+	static int read_length(int length, const uint8_t *src, int src_size, int& ip) {
+		if (length == 15) {
+			uint8_t byte;
+			do {
+				if (ip >= src_size) {
+					return -1;
+				}
+				byte = src[ip++];
+				length += byte;
+			} while (byte == 255);
+		}
+		return length;
 	}
 
-	int xDelete(const char *zName, int syncDir) override {
-		TRACE_LOG("DELETE %s", zName);
-		IdbFileSize file_size(zName, false);
-		if (!file_size.remove()) {
-			return SQLITE_IOERR_DELETE;
+	static int write_sequence(const uint8_t *literals, int literal_length, int offset, int match_length, uint8_t *dst, int op, int dst_capacity) {
+		if (op >= dst_capacity) {
+			return -1;
 		}
-
-		for (int i = 0; ; i++) {
-			IdbPage page(zName, i);
-			if (!page.remove()) {
-				break;
+		int match_nibble = match_length > 0 ? match_length - MIN_MATCH : 0;
+		dst[op++] = (std::min(literal_length, 15) << 4) | std::min(match_nibble, 15);
+		if (literal_length >= 15 && (op = write_length(literal_length, dst, op, dst_capacity)) < 0) {
+			return -1;
+		}
+		if (literal_length > dst_capacity - op) {
+			return -1;
+		}
+		memcpy(dst + op, literals, literal_length);
+		op += literal_length;
+		if (match_length > 0) {
+			if (dst_capacity - op < 2) {
+				return -1;
+			}
+			write_le(dst + op, offset, 2);
+			op += 2;
+			if (match_nibble >= 15 && (op = write_length(match_nibble, dst, op, dst_capacity)) < 0) {
+				return -1;
 			}
 		}
-		rmdir(zName);
-		return SQLITE_OK;
+		return op;
 	}
+};
 
-	int xAccess(const char *zName, int flags, int *pResOut) override {
-		TRACE_LOG("ACCESS %s %d", zName, flags);
-		switch (flags) {
-			case SQLITE_ACCESS_EXISTS:
-			case SQLITE_ACCESS_READWRITE:
-			case SQLITE_ACCESS_READ:
-				IdbFileSize file_size(zName, false);
-				*pResOut = file_size.exists();
-				TRACE_LOG("  > %d", *pResOut);
-				return SQLITE_OK;
+/**
+ * Page file holding variable-length page records, used by databases
+ * with compressed or checksummed pages.
+ *
+ * The file starts with a directory of `extent_pages` entries with the
+ * record offset, length, checksum and flags, followed by the records themselves.
+ * Records with length 0 are pages that were never stored.
+ */
+class IdbPackedExtent {
+public:
+	enum RecordFlags : uint8_t {
+		COMPRESSED = 1 << 0,
+	};
+
+	struct Record {
+		uint8_t flags = 0;
+		/// Checksum of `data` as stored, kept as is when the extent is rewritten
+		uint32_t checksum = 0;
+		std::vector<uint8_t> data;
+
+		bool is_valid() const {
+			return checksum_of(data.data(), data.size()) == checksum;
 		}
-		return SQLITE_NOTFOUND;
-	}
+	};
 
-#ifdef __EMSCRIPTEN__
-	int xFullPathname(const char *zName, int nOut, char *zOut) override {
-		TRACE_LOG("FULL PATH %s", zName);
-		if (zName[0] == '/') {
-			strncpy(zOut, zName, nOut);
+	static constexpr int ENTRY_SIZE = 16;
+
+	/// Same checksum SQLite uses for WAL frames: two running sums over
+	/// 32-bit little-endian words, with the tail padded with zeros.
+	static uint32_t checksum_of(const uint8_t *data, size_t data_size) {
+		uint32_t s1 = 0;
+		uint32_t s2 = 0;
+		size_t i = 0;
+		for (; i + 8 <= data_size; i += 8) {
+			s1 += read_le(data + i, 4) + s2;
+			s2 += read_le(data + i + 4, 4) + s1;
 		}
-		else {
-			snprintf(zOut, nOut, "/idbfs/%s", zName);
+		if (i < data_size) {
+			uint8_t tail[8] = {};
+			memcpy(tail, data + i, data_size - i);
+			s1 += read_le(tail, 4) + s2;
+			s2 += read_le(tail + 4, 4) + s1;
 		}
-		TRACE_LOG(" > %s", zOut);
-		return SQLITE_OK;
+		return s1 ^ s2;
 	}
-#endif
-};
 
-extern "C" {
+	IdbPackedExtent(int extent_pages) : records(extent_pages) {}
+
+	bool parse(const uint8_t *data, size_t data_size) {
+		for (size_t slot = 0; slot < records.size(); slot++) {
+			Record& record = records[slot];
+			size_t entry = slot * ENTRY_SIZE;
+			if (entry + ENTRY_SIZE > data_size) {
+				record = Record();
+				continue;
+			}
+			size_t offset = read_le(data + entry, 4);
+			size_t length = read_le(data + entry + 4, 4);
+			if (offset > data_size || length > data_size - offset) {
+				return false;
+			}
+			record.checksum = read_le(data + entry + 8, 4);
+			record.flags = data[entry + 12];
+			record.data.assign(data + offset, data + offset + length);
+		}
+		return true;
+	}
+
+	std::vector<uint8_t> serialize() const {
+		std::vector<uint8_t> data(records.size() * ENTRY_SIZE);
+		for (size_t slot = 0; slot < records.size(); slot++) {
+			const Record& record = records[slot];
+			uint8_t *entry = &data[slot * ENTRY_SIZE];
+			write_le(entry, record.data.empty() ? 0 : data.size(), 4);
+			write_le(entry + 4, record.data.size(), 4);
+			write_le(entry + 8, record.checksum, 4);
+			entry[12] = record.flags;
+			data.insert(data.end(), record.data.begin(), record.data.end());
+		}
+		return data;
+	}
+
+	/// Encode a page into `slot`, compressing it if enabled and that saves space.
+	void set_page(int slot, const uint8_t *page, int page_size, bool compress) {
+		Record& record = records[slot];
+		record.data.resize(page_size);
+		int compressed_size = compress ? IdbCompression::compress(page, page_size, record.data.data(), page_size - 1) : 0;
+		if (compressed_size > 0) {
+			record.flags = COMPRESSED;
+			record.data.resize(compressed_size);
+		}
+		else {
+			record.flags = 0;
+			record.data.assign(page, page + page_size);
+		}
+		record.checksum = checksum_of(record.data.data(), record.data.size());
+	}
+
+	const std::vector<Record>& get_records() const {
+		return records;
+	}
+
+	void clear_from(int slot) {
+		for (size_t i = slot; i < records.size(); i++) {
+			records[i] = Record();
+		}
+	}
+
+	/// Load the whole extent from a page file.
+	bool load(IdbPageHandles& pages, int file_number) {
+		std::vector<uint8_t> data;
+		int loaded_bytes = pages.load_into(file_number, data, pages.stored_size(file_number));
+		return parse(data.data(), loaded_bytes);
+	}
+
+	bool store(IdbPageHandles& pages, int file_number) const {
+		std::vector<uint8_t> data = serialize();
+		return pages.store(file_number, data, true) == (int) data.size();
+	}
+
+	/// Load a single record from a page file, reading only its directory entry and data.
+	static bool load_record(IdbPageHandles& pages, int file_number, int slot, Record& record) {
+		uint8_t entry[ENTRY_SIZE];
+		if (pages.load_into(file_number, entry, ENTRY_SIZE, (sqlite3_int64) slot * ENTRY_SIZE) < ENTRY_SIZE) {
+			return false;
+		}
+		size_t offset = read_le(entry, 4);
+		size_t length = read_le(entry + 4, 4);
+		record.checksum = read_le(entry + 8, 4);
+		record.flags = entry[12];
+		record.data.resize(length);
+		return length > 0 && pages.load_into(file_number, record.data.data(), length, offset) == (int) length;
+	}
+
+	/// Decode a record into `page`.
+	/// @return Decoded size, or -1 if the record is malformed.
+	static int decode(const Record& record, uint8_t *page, int page_capacity) {
+		if (record.flags & COMPRESSED) {
+			return IdbCompression::decompress(record.data.data(), record.data.size(), page, page_capacity);
+		}
+		int size = std::min<int>(record.data.size(), page_capacity);
+		memcpy(page, record.data.data(), size);
+		return size;
+	}
+
+private:
+	std::vector<Record> records;
+};
+
+/**
+ * In-memory LRU cache of database pages.
+ *
+ * Pages written by SQLite are kept dirty in memory and only stored when
+ * the file is synced, so that rewriting the same page multiple times in a
+ * transaction results in a single store.
+ * Dirty page numbers are kept sorted, so they can be flushed in page order.
+ * Pages are stamped with a clock shared by all caches when used, so that
+ * `IdbCacheBudget` can tell which cache holds the least recently used page.
+ */
+class IdbPageCache {
+public:
+	struct Page {
+		int page_number;
+		std::vector<uint8_t> data;
+		bool is_dirty;
+		/// Number of pointers to `data` handed out by `xFetch` that were not released yet
+		int pin_count;
+		uint64_t last_used;
+	};
+
+	IdbPageCache(size_t max_pages = IDBVFS_CACHE_PAGES) : max_pages(max_pages) {}
+
+	~IdbPageCache() {
+		account(-(long long) bytes);
+	}
+
+	/// Count the bytes held by this cache in `total_bytes` too
+	void set_shared_bytes(std::atomic<long long> *total_bytes) {
+		account(-(long long) bytes);
+		shared_bytes = total_bytes;
+		account(bytes);
+	}
+
+	size_t get_bytes() const {
+		return bytes;
+	}
+
+	/// Clock value of the least recently used page that can be removed, or UINT64_MAX if there is none
+	uint64_t get_least_recently_used_clean_time() const {
+		for (auto it = lru.rbegin(); it != lru.rend(); ++it) {
+			if (!it->is_dirty && it->pin_count == 0) {
+				return it->last_used;
+			}
+		}
+		return UINT64_MAX;
+	}
+
+	bool is_enabled() const {
+		return max_pages > 0;
+	}
+
+	size_t get_max_pages() const {
+		return max_pages;
+	}
+
+	void set_max_pages(size_t max_pages) {
+		this->max_pages = max_pages;
+	}
+
+	bool is_over_capacity() const {
+		return lru.size() > max_pages;
+	}
+
+	bool is_full_of_dirty_pages() const {
+		return dirty_pages.size() >= max_pages;
+	}
+
+	bool has_dirty_pages() const {
+		return !dirty_pages.empty();
+	}
+
+	const std::set<int>& get_dirty_pages() const {
+		return dirty_pages;
+	}
+
+	Page *get(int page_number) {
+		auto it = pages.find(page_number);
+		if (it == pages.end()) {
+			return nullptr;
+		}
+		lru.splice(lru.begin(), lru, it->second);
+		it->second->last_used = clock++;
+		return &*it->second;
+	}
+
+	Page *peek(int page_number) {
+		auto it = pages.find(page_number);
+		return it != pages.end() ? &*it->second : nullptr;
+	}
+
+	Page& put(int page_number, const void *data, size_t data_size, bool is_dirty) {
+		Page *page = get(page_number);
+		if (page != nullptr && page->pin_count > 0 && page->data.size() != data_size) {
+			// resizing would invalidate fetched pointers, so the pinned page is replaced instead
+			erase(pages[page_number]);
+			page = nullptr;
+		}
+		if (page == nullptr) {
+			lru.push_front(Page { page_number, {}, false, 0, clock++ });
+			pages[page_number] = lru.begin();
+			page = &lru.front();
+		}
+		if (page->data.size() == data_size) {
+			// overwrite in place, so that fetched pointers see the new contents
+			memcpy(page->data.data(), data, data_size);
+		}
+		else {
+			account((long long) data_size - (long long) page->data.size());
+			page->data.assign((const uint8_t *) data, (const uint8_t *) data + data_size);
+		}
+		if (is_dirty) {
+			mark_dirty(*page);
+		}
+		return *page;
+	}
+
+	void mark_dirty(Page& page) {
+		page.is_dirty = true;
+		dirty_pages.insert(page.page_number);
+	}
+
+	void mark_clean(Page& page) {
+		page.is_dirty = false;
+		dirty_pages.erase(page.page_number);
+	}
+
+	/// Pin a page, so that its data stays valid until `unpin` is called with it.
+	const void *pin(Page& page) {
+		page.pin_count++;
+		auto it = pages[page.page_number];
+		pinned_pages[page.data.data()] = it;
+		return page.data.data();
+	}
+
+	void unpin(const void *data) {
+		auto pinned = pinned_pages.find(data);
+		if (pinned == pinned_pages.end()) {
+			return;
+		}
+		auto it = pinned->second;
+		if (--it->pin_count > 0) {
+			return;
+		}
+		pinned_pages.erase(pinned);
+		auto cached = pages.find(it->page_number);
+		if (cached == pages.end() || cached->second != it) {
+			account(-(long long) it->data.size());
+			detached_pages.erase(it);
+		}
+	}
+
+	/// Remove the least recently used page that is clean and not pinned.
+	/// @return Number of bytes freed, 0 if no page was removed.
+	size_t remove_least_recently_used_clean() {
+		for (auto it = lru.rbegin(); it != lru.rend(); ++it) {
+			if (!it->is_dirty && it->pin_count == 0) {
+				size_t page_bytes = it->data.size();
+				erase(std::next(it).base());
+				return page_bytes;
+			}
+		}
+		return 0;
+	}
+
+	void remove(int page_number) {
+		auto it = pages.find(page_number);
+		if (it != pages.end()) {
+			erase(it->second);
+		}
+	}
+
+	void remove_dirty() {
+		for (auto it = lru.begin(); it != lru.end(); ) {
+			it = it->is_dirty ? erase(it) : std::next(it);
+		}
+	}
+
+	void remove_beyond(sqlite3_int64 file_size) {
+		for (auto it = lru.begin(); it != lru.end(); ) {
+			if ((sqlite3_int64) it->page_number * (sqlite3_int64) it->data.size() >= file_size) {
+				it = erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+	}
+
+private:
+	size_t max_pages;
+	size_t bytes = 0;
+	std::atomic<long long> *shared_bytes = nullptr;
+	/// Clock shared by all caches, incremented every time a page is used
+	static std::atomic<uint64_t> clock;
+	/// Cached pages, most recently used first
+	std::list<Page> lru;
+	std::unordered_map<int, std::list<Page>::iterator> pages;
+	std::set<int> dirty_pages;
+	/// Pages removed from the cache while still pinned, freed when unpinned
+	std::list<Page> detached_pages;
+	std::unordered_map<const void *, std::list<Page>::iterator> pinned_pages;
+
+	std::list<Page>::iterator erase(std::list<Page>::iterator it) {
+		dirty_pages.erase(it->page_number);
+		pages.erase(it->page_number);
+		if (it->pin_count > 0) {
+			auto next = std::next(it);
+			detached_pages.splice(detached_pages.end(), lru, it);
+			return next;
+		}
+		account(-(long long) it->data.size());
+		return lru.erase(it);
+	}
+
+	void account(long long delta) {
+		bytes += delta;
+		if (shared_bytes) {
+			*shared_bytes += delta;
+		}
+	}
+};
+
+std::atomic<uint64_t> IdbPageCache::clock;
+
+/**
+ * Memory budget shared by the page caches of all idbvfs files.
+ *
+ * Whenever the caches hold more bytes than the budget, clean pages are removed
+ * from whichever cache holds the least recently used one, so that files in
+ * active use keep their pages while idle ones give them up.
+ * Dirty pages don't count against other files, they are freed once their file syncs.
+ * Caches of other files are skipped while they're in use, instead of waiting for them.
+ */
+class IdbCacheBudget {
+public:
+	IdbCacheBudget(long long budget_bytes = IDBVFS_CACHE_BUDGET) : budget_bytes(budget_bytes) {}
+
+	long long get_budget() const {
+		return budget_bytes;
+	}
+
+	void set_budget(long long new_budget_bytes) {
+		budget_bytes = new_budget_bytes;
+	}
+
+	long long get_used() const {
+		return used_bytes;
+	}
+
+	void join(IdbPageCache& cache, std::mutex& mutex) {
+		std::lock_guard<std::mutex> lock(members_mutex);
+		cache.set_shared_bytes(&used_bytes);
+		members.push_back(Member { &cache, &mutex });
+	}
+
+	void leave(IdbPageCache& cache) {
+		std::lock_guard<std::mutex> lock(members_mutex);
+		members.erase(std::remove_if(members.begin(), members.end(), [&](const Member& member) {
+			return member.cache == &cache;
+		}), members.end());
+		cache.set_shared_bytes(nullptr);
+	}
+
+	/// Remove pages until the caches fit in the budget.
+	/// @param locked_cache  Cache whose file is already locked by the caller, if any.
+	void reclaim(IdbPageCache *locked_cache = nullptr) {
+		if (budget_bytes > 0 && used_bytes > budget_bytes) {
+			release(used_bytes - budget_bytes, locked_cache);
+		}
+	}
+
+	/// Remove the least recently used clean pages of all caches.
+	/// @return Number of bytes freed, which may be less than requested if pages are dirty or in use.
+	long long release(long long bytes_to_free, IdbPageCache *locked_cache = nullptr) {
+		std::lock_guard<std::mutex> lock(members_mutex);
+		long long freed_bytes = 0;
+		std::vector<std::unique_lock<std::mutex>> locks;
+		std::vector<IdbPageCache *> caches;
+		for (const Member& member : members) {
+			if (member.cache == locked_cache) {
+				caches.push_back(member.cache);
+				continue;
+			}
+			std::unique_lock<std::mutex> member_lock(*member.mutex, std::try_to_lock);
+			if (member_lock.owns_lock()) {
+				locks.push_back(std::move(member_lock));
+				caches.push_back(member.cache);
+			}
+		}
+		while (freed_bytes < bytes_to_free) {
+			IdbPageCache *oldest_cache = nullptr;
+			uint64_t oldest_time = UINT64_MAX;
+			for (IdbPageCache *cache : caches) {
+				uint64_t time = cache->get_least_recently_used_clean_time();
+				if (time < oldest_time) {
+					oldest_time = time;
+					oldest_cache = cache;
+				}
+			}
+			if (oldest_cache == nullptr) {
+				break;
+			}
+			freed_bytes += oldest_cache->remove_least_recently_used_clean();
+		}
+		return freed_bytes;
+	}
+
+private:
+	struct Member {
+		IdbPageCache *cache;
+		/// Mutex of the file that owns the cache
+		std::mutex *mutex;
+	};
+
+	std::atomic<long long> budget_bytes;
+	std::atomic<long long> used_bytes { 0 };
+	std::mutex members_mutex;
+	std::vector<Member> members;
+};
+
+/**
+ * Metadata of an idbvfs file.
+ *
+ * Stored as a fixed size little-endian binary header under `IDBVFS_SIZE_KEY`,
+ * where legacy versions stored the file size as decimal text, optionally
+ * followed by the number of pages per extent.
+ * Legacy headers are still loaded and get rewritten as binary on the next sync.
+ */
+struct IdbFileMetadata {
+	static constexpr uint8_t MAGIC[4] = { 'I', 'D', 'B', 'V' };
+	static constexpr uint8_t LAYOUT_VERSION = 1;
+	static constexpr size_t STORED_SIZE = 40;
+
+	enum Flags : uint8_t {
+		/// Page files are `IdbPackedExtent`s with compressed page records
+		COMPRESSED_PAGES = 1 << 0,
+		/// Page files are `IdbPackedExtent`s, whose records are checksummed, even without compression
+		PAGE_CHECKSUMS = 1 << 1,
+		/// Page files are spread over subdirectories, see `IdbPageHandles`
+		FANOUT_DIRECTORIES = 1 << 2,
+		/// Copy-on-write snapshot that reads missing page files from the database named under `IDBVFS_SNAPSHOT_OF_KEY`
+		SNAPSHOT = 1 << 3,
+		/// The file grew ahead of its writes, so pages at its end may be missing from storage and read as zeros
+		PREALLOCATED = 1 << 4,
+	};
+
+	/// Whether the header is stored at all
+	bool exists = false;
+	/// Files with a newer layout version than `LAYOUT_VERSION` were written by a newer version of idbvfs and can't be opened
+	uint8_t layout_version = LAYOUT_VERSION;
+	/// Layout options, fixed when the file is created
+	uint8_t flags = 0;
+	/// Size of the pages database files are stored in, independent of SQLite's page size.
+	/// Fixed when the first page is written, 0 for journals and legacy headers.
+	uint32_t page_size = 0;
+	uint32_t extent_pages = 1;
+	uint64_t file_size = 0;
+	uint64_t page_count = 0;
+	/// Incremented every time the header is stored
+	uint64_t generation = 0;
+
+	bool parse(const uint8_t *data, size_t data_size) {
+		if (data_size >= STORED_SIZE && memcmp(data, MAGIC, sizeof(MAGIC)) == 0) {
+			layout_version = data[4];
+			flags = data[5];
+			page_size = read_le(data + 8, 4);
+			extent_pages = read_le(data + 12, 4);
+			file_size = read_le(data + 16, 8);
+			page_count = read_le(data + 24, 8);
+			generation = read_le(data + 32, 8);
+		}
+		else {
+			std::string text((const char *) data, data_size);
+			unsigned long long legacy_file_size;
+			int legacy_extent_pages = 1;
+			if (sscanf(text.c_str(), "%llu %d", &legacy_file_size, &legacy_extent_pages) < 1) {
+				return false;
+			}
+			file_size = legacy_file_size;
+			extent_pages = legacy_extent_pages;
+		}
+		if (extent_pages < 1) {
+			extent_pages = 1;
+		}
+		exists = true;
+		return true;
+	}
+
+	bool is_supported() const {
+		return layout_version <= LAYOUT_VERSION;
+	}
+
+	void serialize(uint8_t out[STORED_SIZE]) const {
+		memcpy(out, MAGIC, sizeof(MAGIC));
+		out[4] = layout_version;
+		out[5] = flags;
+		write_le(out + 6, 0, 2);
+		write_le(out + 8, page_size, 4);
+		write_le(out + 12, extent_pages, 4);
+		write_le(out + 16, file_size, 8);
+		write_le(out + 24, page_count, 8);
+		write_le(out + 32, generation, 8);
+	}
+};
+
+constexpr uint8_t IdbFileMetadata::MAGIC[4];
+
+struct IdbFileHeader : public IdbPage {
+	IdbFileHeader() : IdbPage() {}
+	IdbFileHeader(sqlite3_filename file_name, const IdbFileMetadata& stored_metadata, int new_file_extent_pages = 1, uint8_t new_file_flags = 0)
+		: IdbPage(file_name, IDBVFS_SIZE_KEY)
+		, metadata(stored_metadata)
+	{
+		if (!metadata.exists) {
+			metadata.extent_pages = new_file_extent_pages > 0 ? new_file_extent_pages : 1;
+			metadata.flags = new_file_flags;
+		}
+	}
+
+	static IdbFileMetadata load(const char *file_name) {
+		IdbFileMetadata metadata;
+		uint8_t data[64];
+		int loaded_bytes = IdbPage(file_name, IDBVFS_SIZE_KEY).load_into(data, sizeof(data));
+		metadata.parse(data, loaded_bytes);
+		return metadata;
+	}
+
+	const IdbFileMetadata& get_metadata() const {
+		return metadata;
+	}
+
+	size_t get() const {
+		return metadata.file_size;
+	}
+
+	int get_extent_pages() const {
+		return metadata.extent_pages;
+	}
+
+	int get_page_size() const {
+		return metadata.page_size;
+	}
+
+	bool has_flag(IdbFileMetadata::Flags flag) const {
+		return metadata.flags & flag;
+	}
+
+	/// Number of page files holding the stored data, or -1 if unknown, as in legacy headers.
+	int get_file_count() const {
+		if (metadata.page_size == 0) {
+			return -1;
+		}
+		return (metadata.page_count + metadata.extent_pages - 1) / metadata.extent_pages;
+	}
+
+	void set(size_t new_file_size) {
+		if (new_file_size != metadata.file_size) {
+			metadata.file_size = new_file_size;
+			is_dirty = true;
+		}
+	}
+
+	void set_page_size(uint32_t page_size) {
+		if (page_size != metadata.page_size) {
+			metadata.page_size = page_size;
+			is_dirty = true;
+		}
+	}
+
+	void set_flag(IdbFileMetadata::Flags flag) {
+		if (!has_flag(flag)) {
+			metadata.flags |= flag;
+			is_dirty = true;
+		}
+	}
+
+	bool needs_sync() const {
+		return is_dirty;
+	}
+
+	/// Forget the stored metadata, keeping the layout options for when the file gets written again
+	void reset() {
+		IdbFileMetadata new_metadata;
+		new_metadata.extent_pages = metadata.extent_pages;
+		new_metadata.flags = metadata.flags & ~(IdbFileMetadata::SNAPSHOT | IdbFileMetadata::PREALLOCATED);
+		metadata = new_metadata;
+		is_dirty = false;
+	}
+
+	/// Store a copy of another file's metadata on the next sync
+	void copy_from(const IdbFileMetadata& other_metadata) {
+		metadata = other_metadata;
+		is_dirty = true;
+	}
+
+	bool sync() {
+		if (is_dirty) {
+			IdbFileMetadata stored_metadata = metadata;
+			stored_metadata.layout_version = IdbFileMetadata::LAYOUT_VERSION;
+			stored_metadata.page_count = metadata.page_size > 0 ? (metadata.file_size + metadata.page_size - 1) / metadata.page_size : 0;
+			stored_metadata.generation++;
+			uint8_t data[IdbFileMetadata::STORED_SIZE];
+			stored_metadata.serialize(data);
+			if (store(data, sizeof(data)) < (int) sizeof(data)) {
+				return false;
+			}
+			stored_metadata.exists = true;
+			metadata = stored_metadata;
+			is_dirty = false;
+		}
+		return true;
+	}
+
+private:
+	IdbFileMetadata metadata;
+	bool is_dirty = false;
+};
+
+/**
+ * Links between copy-on-write snapshots and the databases they were taken from.
+ *
+ * Snapshots store the name of their source under `IDBVFS_SNAPSHOT_OF_KEY`,
+ * while sources list their snapshots under `IDBVFS_SNAPSHOTS_KEY`, so that
+ * they know where to copy page files before changing them.
+ */
+struct IdbSnapshotLinks {
+	static std::string load_source(const char *name) {
+		return IdbPage(name, IDBVFS_SNAPSHOT_OF_KEY).load_text();
+	}
+
+	/// Chain of sources a snapshot reads page files from, nearest first
+	static std::vector<std::string> load_bases(const char *name) {
+		std::vector<std::string> bases;
+		for (std::string base = load_source(name); !base.empty(); base = load_source(base.c_str())) {
+			if (base == name || std::find(bases.begin(), bases.end(), base) != bases.end()) {
+				break;
+			}
+			bases.push_back(base);
+		}
+		return bases;
+	}
+
+	static std::vector<std::string> load_snapshots(const char *name) {
+		std::vector<std::string> snapshots;
+		std::string text = IdbPage(name, IDBVFS_SNAPSHOTS_KEY).load_text();
+		size_t start = 0;
+		while (start < text.size()) {
+			size_t end = text.find('\n', start);
+			if (end == std::string::npos) {
+				end = text.size();
+			}
+			if (end > start) {
+				snapshots.push_back(text.substr(start, end - start));
+			}
+			start = end + 1;
+		}
+		return snapshots;
+	}
+
+	static bool store_snapshots(const char *name, const std::vector<std::string>& snapshots) {
+		IdbPage page(name, IDBVFS_SNAPSHOTS_KEY);
+		if (snapshots.empty()) {
+			return page.remove() || errno == ENOENT;
+		}
+		std::string text;
+		for (const std::string& snapshot : snapshots) {
+			text.append(snapshot);
+			text.append("\n");
+		}
+		return page.store(text) == (int) text.size();
+	}
+};
+
+/**
+ * Redo record that makes batch atomic writes atomic.
+ *
+ * Page files are stored one at a time, so a commit that stops midway would
+ * leave the database with only part of a batch, and SQLite doesn't write a
+ * rollback journal for batches.
+ * Instead, all pages of the batch and the new file size are first stored in a
+ * single file under `IDBVFS_BATCH_KEY`, ending with a checksum of the record.
+ * Storing the whole record commits the batch: records are removed once their
+ * pages and file size are stored, and complete records found when opening
+ * the database are applied again, while incomplete ones are ignored.
+ */
+class IdbBatchRecord {
+public:
+	static constexpr uint8_t MAGIC[4] = { 'I', 'D', 'B', 'B' };
+	static constexpr size_t HEADER_SIZE = 16;
+	static constexpr size_t CHECKSUM_SIZE = 4;
+
+	/// Store the dirty pages of `cache`, returns whether the whole record was stored
+	static bool store(const char *dbname, sqlite3_int64 file_size, int page_size, IdbPageCache& cache) {
+		const std::set<int>& dirty_pages = cache.get_dirty_pages();
+		std::vector<uint8_t> data(HEADER_SIZE + dirty_pages.size() * (4 + (size_t) page_size) + CHECKSUM_SIZE);
+		memcpy(data.data(), MAGIC, sizeof(MAGIC));
+		write_le(data.data() + 4, page_size, 4);
+		write_le(data.data() + 8, file_size, 8);
+		size_t offset = HEADER_SIZE;
+		for (int page_number : dirty_pages) {
+			write_le(data.data() + offset, page_number, 4);
+			memcpy(data.data() + offset + 4, cache.peek(page_number)->data.data(), page_size);
+			offset += 4 + page_size;
+		}
+		write_le(data.data() + offset, IdbPackedExtent::checksum_of(data.data(), offset), CHECKSUM_SIZE);
+		return IdbPage(dbname, IDBVFS_BATCH_KEY).store(data.data(), data.size()) == (int) data.size();
+	}
+
+	static void remove(const char *dbname) {
+		IdbPage(dbname, IDBVFS_BATCH_KEY).remove();
+	}
+
+	/// Load the record of a database, returns false if there is none or it is incomplete
+	bool load(const char *dbname) {
+		data = IdbPage(dbname, IDBVFS_BATCH_KEY).load_text();
+		if (data.size() < HEADER_SIZE + CHECKSUM_SIZE || memcmp(data.data(), MAGIC, sizeof(MAGIC)) != 0) {
+			return false;
+		}
+		const uint8_t *bytes = (const uint8_t *) data.data();
+		size_t checksum_offset = data.size() - CHECKSUM_SIZE;
+		if (read_le(bytes + checksum_offset, CHECKSUM_SIZE) != IdbPackedExtent::checksum_of(bytes, checksum_offset)) {
+			return false;
+		}
+		int page_size = get_page_size();
+		return page_size > 0 && (checksum_offset - HEADER_SIZE) % (4 + (size_t) page_size) == 0;
+	}
+
+	int get_page_size() const {
+		return read_le((const uint8_t *) data.data() + 4, 4);
+	}
+
+	sqlite3_int64 get_file_size() const {
+		return read_le((const uint8_t *) data.data() + 8, 8);
+	}
+
+	int get_page_count() const {
+		return (data.size() - HEADER_SIZE - CHECKSUM_SIZE) / (4 + (size_t) get_page_size());
+	}
+
+	int get_page_number(int index) const {
+		return read_le(get_entry(index), 4);
+	}
+
+	const uint8_t *get_page_data(int index) const {
+		return get_entry(index) + 4;
+	}
+
+private:
+	std::string data;
+
+	const uint8_t *get_entry(int index) const {
+		return (const uint8_t *) data.data() + HEADER_SIZE + (size_t) index * (4 + get_page_size());
+	}
+};
+
+constexpr uint8_t IdbBatchRecord::MAGIC[4];
+
+/**
+ * Cache of stored file metadata shared by the whole VFS, keyed by file name.
+ *
+ * Changes to idbvfs files go through the VFS, which keeps the entries up to
+ * date, so opening a file or checking whether it exists only touches storage
+ * the first time. Files deleted by the VFS keep an entry saying they don't exist,
+ * while names that were only probed are forgotten when a database that was
+ * never created is closed.
+ */
+class IdbMetadataRegistry {
+public:
+	IdbFileMetadata get(const std::string& file_name) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = entries.find(file_name);
+		if (it == entries.end()) {
+			it = entries.emplace(file_name, Entry { IdbFileHeader::load(file_name.c_str()), true }).first;
+		}
+		return it->second.metadata;
+	}
+
+	void put(const std::string& file_name, const IdbFileMetadata& metadata) {
+		std::lock_guard<std::mutex> lock(mutex);
+		entries[file_name] = Entry { metadata, false };
+	}
+
+	void remove(const std::string& file_name) {
+		put(file_name, IdbFileMetadata());
+	}
+
+	/// Drop the entry of a file that was only probed and doesn't exist, so that names that were never used don't stay in memory
+	void forget_if_probed_missing(const std::string& file_name) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = entries.find(file_name);
+		if (it != entries.end() && it->second.is_probe && !it->second.metadata.exists) {
+			entries.erase(it);
+		}
+	}
+
+private:
+	struct Entry {
+		IdbFileMetadata metadata;
+		/// Whether the metadata was loaded from storage and never written or removed by the VFS
+		bool is_probe;
+	};
+
+	std::mutex mutex;
+	std::unordered_map<std::string, Entry> entries;
+};
+
+/**
+ * Helpers for recording I/O statistics in `idbvfs_stats`.
+ */
+class IdbStats {
+public:
+	/// Adds the time elapsed between its construction and destruction
+	/// to a latency histogram.
+	class LatencyTimer {
+	public:
+		LatencyTimer(long long *histogram)
+			: histogram(histogram)
+			, start(std::chrono::steady_clock::now())
+		{
+		}
+
+		~LatencyTimer() {
+			auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+			histogram[bucket_of(elapsed)]++;
+		}
+
+	private:
+		long long *histogram;
+		std::chrono::steady_clock::time_point start;
+	};
+
+	/// Bucket `i` counts operations that took less than 2^i microseconds.
+	static int bucket_of(long long microseconds) {
+		int bucket = 0;
+		while (bucket < IDBVFS_STATS_LATENCY_BUCKETS - 1 && microseconds >= (1LL << bucket)) {
+			bucket++;
+		}
+		return bucket;
+	}
+
+	static void add(idbvfs_stats& totals, const idbvfs_stats& stats) {
+		totals.pages_written += stats.pages_written;
+		totals.pages_flushed += stats.pages_flushed;
+		totals.reads += stats.reads;
+		totals.writes += stats.writes;
+		totals.syncs += stats.syncs;
+		totals.bytes_read += stats.bytes_read;
+		totals.bytes_written += stats.bytes_written;
+		totals.cache_hits += stats.cache_hits;
+		totals.cache_misses += stats.cache_misses;
+		totals.pages_read_ahead += stats.pages_read_ahead;
+		for (int i = 0; i < IDBVFS_STATS_LATENCY_BUCKETS; i++) {
+			totals.read_latency[i] += stats.read_latency[i];
+			totals.write_latency[i] += stats.write_latency[i];
+			totals.sync_latency[i] += stats.sync_latency[i];
+		}
+	}
+};
+
+/**
+ * Statistics of files that were already closed, so that global statistics
+ * account for every file opened by the VFS.
+ */
+class IdbClosedFileStats {
+public:
+	void add(const idbvfs_stats& stats) {
+		std::lock_guard<std::mutex> lock(mutex);
+		IdbStats::add(totals, stats);
+	}
+
+	idbvfs_stats get() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return totals;
+	}
+
+private:
+	std::mutex mutex;
+	idbvfs_stats totals = {};
+};
+
+/**
+ * Tracer that records VFS operations as binary events in a ring buffer.
+ *
+ * Tracing is enabled at runtime and costs a single atomic load per
+ * operation while disabled. Recording events is lock-free: each event
+ * claims a slot by incrementing the write index, and the slot sequence
+ * number tells the drain whether the event was completely written.
+ * Events that are not drained before the buffer wraps around are dropped.
+ */
+class IdbTracer {
+public:
+	/// Records an event for the operation in its scope, if tracing is enabled.
+	class Scope {
+	public:
+		Scope(int op, uint32_t file_id, sqlite3_int64 offset = 0, int size = 0)
+			: is_enabled(IdbTracer::is_enabled())
+		{
+			if (is_enabled) {
+				event.op = op;
+				event.file_id = file_id;
+				event.offset = offset;
+				event.size = size;
+				event.timestamp = now();
+			}
+		}
+
+		~Scope() {
+			if (is_enabled) {
+				event.duration = now() - event.timestamp;
+				IdbTracer::push(event);
+			}
+		}
+
+		void set_offset(sqlite3_int64 offset) {
+			event.offset = offset;
+		}
+
+		int finish(int result) {
+			event.result = result;
+			return result;
+		}
+
+	private:
+		bool is_enabled;
+		idbvfs_trace_event event = {};
+	};
+
+	/// FNV-1a hash of the file name, so that events don't need to store names.
+	static uint32_t file_id(const char *file_name) {
+		uint32_t hash = 2166136261u;
+		for (const char *c = file_name; c != nullptr && *c; c++) {
+			hash = (hash ^ (uint8_t) *c) * 16777619u;
+		}
+		return hash;
+	}
+
+	/// Pairs with the release store in `enable`, so that enabled tracers see the allocated ring buffer.
+	static bool is_enabled() {
+		return enabled.load(std::memory_order_acquire);
+	}
+
+	static bool enable(bool enable) {
+		if (enable && slots.load(std::memory_order_acquire) == nullptr) {
+			std::lock_guard<std::mutex> lock(drain_mutex);
+			if (slots.load(std::memory_order_acquire) == nullptr) {
+				// never freed, since operations in flight may still be writing to it
+				Slot *buffer = new (std::nothrow) Slot[IDBVFS_TRACE_EVENTS];
+				if (buffer == nullptr) {
+					return false;
+				}
+				slots.store(buffer, std::memory_order_release);
+			}
+		}
+		enabled.store(enable, std::memory_order_release);
+		return true;
+	}
+
+	/// Copy recorded events to `events`, oldest first.
+	static int drain(idbvfs_trace_event *events, int max_events, long long *dropped_events) {
+		std::lock_guard<std::mutex> lock(drain_mutex);
+		Slot *buffer = slots.load(std::memory_order_acquire);
+		long long dropped = 0;
+		int count = 0;
+		if (buffer != nullptr) {
+			uint64_t end = head.load(std::memory_order_acquire);
+			if (end - tail > IDBVFS_TRACE_EVENTS) {
+				dropped += end - tail - IDBVFS_TRACE_EVENTS;
+				tail = end - IDBVFS_TRACE_EVENTS;
+			}
+			while (tail < end && count < max_events) {
+				Slot& slot = buffer[tail % IDBVFS_TRACE_EVENTS];
+				uint64_t complete_sequence = 2 * tail + 2;
+				uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+				if (sequence < complete_sequence) {
+					// still being written, leave it for the next drain
+					break;
+				}
+				if (sequence == complete_sequence) {
+					slot.load(events[count]);
+					std::atomic_thread_fence(std::memory_order_acquire);
+					if (slot.sequence.load(std::memory_order_relaxed) == complete_sequence) {
+						count++;
+						tail++;
+						continue;
+					}
+				}
+				// overwritten by an event recorded after the buffer wrapped around
+				dropped++;
+				tail++;
+			}
+		}
+		if (dropped_events) {
+			*dropped_events = dropped;
+		}
+		return count;
+	}
+
+private:
+	/// Events are copied word by word with relaxed atomics, so that the
+	/// drain may read a slot while it is being overwritten without a data race.
+	struct Slot {
+		static constexpr int WORDS = sizeof(idbvfs_trace_event) / sizeof(uint64_t);
+		static_assert(sizeof(idbvfs_trace_event) % sizeof(uint64_t) == 0, "trace events must be made of whole words");
+
+		/// 2 * index + 1 while the event at `index` is being written, 2 * index + 2 once it's complete
+		std::atomic<uint64_t> sequence{0};
+		std::atomic<uint64_t> words[WORDS];
+
+		void store(const idbvfs_trace_event& event) {
+			uint64_t data[WORDS];
+			memcpy(data, &event, sizeof(event));
+			for (int i = 0; i < WORDS; i++) {
+				words[i].store(data[i], std::memory_order_relaxed);
+			}
+		}
+
+		void load(idbvfs_trace_event& event) const {
+			uint64_t data[WORDS];
+			for (int i = 0; i < WORDS; i++) {
+				data[i] = words[i].load(std::memory_order_relaxed);
+			}
+			memcpy(&event, data, sizeof(event));
+		}
+	};
+
+	static long long now() {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static void push(const idbvfs_trace_event& event) {
+		Slot *buffer = slots.load(std::memory_order_acquire);
+		uint64_t index = head.fetch_add(1, std::memory_order_relaxed);
+		Slot& slot = buffer[index % IDBVFS_TRACE_EVENTS];
+		slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot.store(event);
+		slot.sequence.store(2 * index + 2, std::memory_order_release);
+	}
+
+	static std::atomic<bool> enabled;
+	static std::atomic<Slot *> slots;
+	static std::atomic<uint64_t> head;
+	/// Index of the next event to drain, guarded by `drain_mutex`
+	static uint64_t tail;
+	static std::mutex drain_mutex;
+};
+
+std::atomic<bool> IdbTracer::enabled(false);
+std::atomic<IdbTracer::Slot *> IdbTracer::slots(nullptr);
+std::atomic<uint64_t> IdbTracer::head(0);
+uint64_t IdbTracer::tail = 0;
+std::mutex IdbTracer::drain_mutex;
+
+/**
+ * Journal contents, kept in memory while the journal file is open.
+ *
+ * Journals are stored in page files of `IDBVFS_JOURNAL_CHUNK_SIZE` bytes
+ * and only byte ranges modified since the last sync are stored again, so
+ * syncing a growing journal doesn't rewrite all of it.
+ * Journals stored by previous versions, which keep all data in page file 0,
+ * are still readable.
+ */
+class IdbJournal {
+public:
+	bool is_loaded() const {
+		return loaded;
+	}
+
+	size_t size() const {
+		return data.size();
+	}
+
+	bool has_dirty_data() const {
+		return is_legacy || !dirty_ranges.empty();
+	}
+
+	void load(IdbPageHandles& pages, size_t stored_size) {
+		data.resize(stored_size);
+		// page file 0 of legacy journals contains the whole journal, so ask for all of it
+		size_t offset = pages.load_into(0, data.data(), stored_size);
+		is_legacy = offset > IDBVFS_JOURNAL_CHUNK_SIZE;
+		for (int file_number = 1; offset > 0 && offset < stored_size; file_number++) {
+			size_t chunk_size = std::min(stored_size - offset, (size_t) IDBVFS_JOURNAL_CHUNK_SIZE);
+			int loaded_bytes = pages.load_into(file_number, data.data() + offset, chunk_size);
+			if (loaded_bytes <= 0) {
+				break;
+			}
+			offset += loaded_bytes;
+		}
+		data.resize(offset);
+		if (is_legacy) {
+			// rewrite legacy journals as chunks on the next sync
+			mark_dirty(0, offset);
+		}
+		loaded = true;
+	}
+
+	bool read(void *p, int iAmt, sqlite3_int64 iOfst) const {
+		if (iAmt + iOfst > (sqlite3_int64) data.size()) {
+			return false;
+		}
+		memcpy(p, data.data() + iOfst, iAmt);
+		return true;
+	}
+
+	void write(const void *p, int iAmt, sqlite3_int64 iOfst) {
+		if (iAmt + iOfst > (sqlite3_int64) data.size()) {
+			data.resize(iAmt + iOfst);
+		}
+		memcpy(data.data() + iOfst, p, iAmt);
+		mark_dirty(iOfst, iAmt + iOfst);
+	}
+
+	void truncate(size_t new_size) {
+		if (new_size == 0) {
+			// release memory, journals are commonly truncated after each transaction
+			std::vector<uint8_t>().swap(data);
+			dirty_ranges.clear();
+		}
+		else if (new_size < data.size()) {
+			data.resize(new_size);
+			dirty_ranges.erase(dirty_ranges.lower_bound(chunk_of(new_size - 1) + 1), dirty_ranges.end());
+			auto last = dirty_ranges.find(chunk_of(new_size - 1));
+			if (last != dirty_ranges.end()) {
+				size_t end_in_chunk = new_size - chunk_start(last->first);
+				last->second.second = std::min(last->second.second, end_in_chunk);
+				if (last->second.first >= last->second.second) {
+					dirty_ranges.erase(last);
+				}
+			}
+		}
+		loaded = true;
+	}
+
+	bool flush(IdbPageHandles& pages) {
+		if (is_legacy) {
+			// shrink legacy page file 0 to a single chunk
+			size_t chunk_size = std::min(data.size(), (size_t) IDBVFS_JOURNAL_CHUNK_SIZE);
+			if (pages.store(0, data.data(), chunk_size, 0, true) < (int) chunk_size) {
+				return false;
+			}
+			dirty_ranges.erase(0);
+			is_legacy = false;
+		}
+		for (auto it = dirty_ranges.begin(); it != dirty_ranges.end(); it = dirty_ranges.erase(it)) {
+			size_t begin = it->second.first, end = it->second.second;
+			const uint8_t *chunk = data.data() + chunk_start(it->first);
+			if (pages.store(it->first, chunk + begin, end - begin, begin) < (int) (end - begin)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	static int chunk_of(size_t offset) {
+		return offset / IDBVFS_JOURNAL_CHUNK_SIZE;
+	}
+
+	static size_t chunk_start(int chunk) {
+		return (size_t) chunk * IDBVFS_JOURNAL_CHUNK_SIZE;
+	}
+
+	void mark_dirty(size_t begin, size_t end) {
+		for (int chunk = chunk_of(begin); begin < end; chunk++) {
+			size_t chunk_end = std::min(end, chunk_start(chunk + 1));
+			size_t begin_in_chunk = begin - chunk_start(chunk), end_in_chunk = chunk_end - chunk_start(chunk);
+			auto it = dirty_ranges.find(chunk);
+			if (it == dirty_ranges.end()) {
+				dirty_ranges[chunk] = std::make_pair(begin_in_chunk, end_in_chunk);
+			}
+			else {
+				it->second.first = std::min(it->second.first, begin_in_chunk);
+				it->second.second = std::max(it->second.second, end_in_chunk);
+			}
+			begin = chunk_end;
+		}
+	}
+
+	std::vector<uint8_t> data;
+	/// Modified byte ranges since last flush, keyed by chunk number, relative to the chunk start
+	std::map<int, std::pair<size_t, size_t>> dirty_ranges;
+	bool loaded = false;
+	bool is_legacy = false;
+};
+
+/**
+ * Heap-backed WAL index, shared by all connections to a database.
+ *
+ * Since it is not persisted, SQLite rebuilds the WAL index from the WAL
+ * file whenever a database in WAL mode is opened for the first time.
+ */
+class IdbShm {
+public:
+	/// WAL index locks held by a connection, one bit per lock slot
+	struct Locks {
+		uint16_t shared;
+		uint16_t exclusive;
+	};
+
+	int map(int region, int region_size, bool extend, void volatile **pp) {
+		while ((int) regions.size() <= region) {
+			if (!extend) {
+				*pp = nullptr;
+				return SQLITE_OK;
+			}
+			uint8_t *new_region = new (std::nothrow) uint8_t[region_size]();
+			if (new_region == nullptr) {
+				return SQLITE_NOMEM;
+			}
+			regions.emplace_back(new_region);
+		}
+		*pp = regions[region].get();
+		return SQLITE_OK;
+	}
+
+	void unmap() {
+		regions.clear();
+	}
+
+	int lock(Locks& locks, int offset, int n, int flags) {
+		uint16_t mask = ((1 << n) - 1) << offset;
+		if (flags & SQLITE_SHM_UNLOCK) {
+			for (int i = offset; i < offset + n; i++) {
+				if (locks.shared & (1 << i)) {
+					shared_count[i]--;
+				}
+				if (locks.exclusive & (1 << i)) {
+					is_exclusive[i] = false;
+				}
+			}
+			locks.shared &= ~mask;
+			locks.exclusive &= ~mask;
+			return SQLITE_OK;
+		}
+		else if (flags & SQLITE_SHM_SHARED) {
+			if ((locks.shared & mask) == 0) {
+				if (is_exclusive[offset]) {
+					return SQLITE_BUSY;
+				}
+				shared_count[offset]++;
+				locks.shared |= mask;
+			}
+			return SQLITE_OK;
+		}
+		else {
+			for (int i = offset; i < offset + n; i++) {
+				bool owns_exclusive = locks.exclusive & (1 << i);
+				int other_shared = shared_count[i] - ((locks.shared & (1 << i)) ? 1 : 0);
+				if ((is_exclusive[i] && !owns_exclusive) || other_shared > 0) {
+					return SQLITE_BUSY;
+				}
+			}
+			for (int i = offset; i < offset + n; i++) {
+				is_exclusive[i] = true;
+			}
+			locks.exclusive |= mask;
+			return SQLITE_OK;
+		}
+	}
+
+	/// Number of connections that currently have the WAL index mapped
+	int users = 0;
+
+private:
+	std::vector<std::unique_ptr<uint8_t[]>> regions;
+	int shared_count[SQLITE_SHM_NLOCK] = {};
+	bool is_exclusive[SQLITE_SHM_NLOCK] = {};
+};
+
+/**
+ * In-process database lock, shared by all connections to a database.
+ *
+ * Follows the same protocol as SQLite's builtin VFSs: any number of
+ * connections may hold SHARED locks, a single one may hold RESERVED while
+ * others keep reading, and PENDING keeps new readers out until the writer
+ * gets its EXCLUSIVE lock once the remaining readers are gone.
+ * Each connection passes its own lock level, which gets updated on success.
+ */
+class IdbFileLock {
+public:
+	int lock(int& level, int new_level) {
+		if (level >= new_level) {
+			return SQLITE_OK;
+		}
+		switch (new_level) {
+			case SQLITE_LOCK_SHARED:
+				if (is_pending || is_exclusive) {
+					return SQLITE_BUSY;
+				}
+				shared_count++;
+				level = SQLITE_LOCK_SHARED;
+				return SQLITE_OK;
+
+			case SQLITE_LOCK_RESERVED:
+				if (level != SQLITE_LOCK_SHARED || is_reserved) {
+					return SQLITE_BUSY;
+				}
+				is_reserved = true;
+				level = SQLITE_LOCK_RESERVED;
+				return SQLITE_OK;
+
+			case SQLITE_LOCK_EXCLUSIVE:
+				if (level == SQLITE_LOCK_SHARED) {
+					if (is_reserved) {
+						return SQLITE_BUSY;
+					}
+					is_reserved = true;
+				}
+				else if (level == SQLITE_LOCK_NONE) {
+					return SQLITE_BUSY;
+				}
+				is_pending = true;
+				level = SQLITE_LOCK_PENDING;
+				if (shared_count > 1) {
+					// keep PENDING so that no new readers come in while waiting for the current ones
+					return SQLITE_BUSY;
+				}
+				is_exclusive = true;
+				level = SQLITE_LOCK_EXCLUSIVE;
+				return SQLITE_OK;
+
+			default:
+				return SQLITE_BUSY;
+		}
+	}
+
+	void unlock(int& level, int new_level) {
+		if (level <= new_level) {
+			return;
+		}
+		if (level >= SQLITE_LOCK_RESERVED) {
+			is_reserved = false;
+			is_pending = false;
+			is_exclusive = false;
+		}
+		if (new_level == SQLITE_LOCK_NONE) {
+			shared_count--;
+		}
+		level = new_level;
+	}
+
+	bool has_reserved() const {
+		return is_reserved;
+	}
+
+private:
+	/// Number of connections holding SHARED or greater locks
+	int shared_count = 0;
+	bool is_reserved = false;
+	bool is_pending = false;
+	bool is_exclusive = false;
+};
+
+/**
+ * When data synced by SQLite gets persisted to Indexed DB.
+ *
+ * Syncing always stores data in the file system, but `FS.syncfs` diffs the
+ * whole file system against Indexed DB, so it may be delayed or left for
+ * `idbvfs_flush` to coalesce several transactions into a single persist.
+ */
+struct IdbSyncPolicy {
+	int policy = IDBVFS_SYNC_IMMEDIATE;
+	int delay_ms = IDBVFS_SYNC_DELAY_MS;
+
+	/// Policy used by files that don't have a "sync" URI parameter, set with `idbvfs_set_sync_policy`
+	static IdbSyncPolicy default_policy;
+
+	static bool is_valid(int policy, int delay_ms) {
+		return policy >= IDBVFS_SYNC_IMMEDIATE && policy <= IDBVFS_SYNC_MANUAL && delay_ms >= 0;
+	}
+
+	/// Read the policy from "sync" and "sync_delay" URI parameters, falling back to the default policy.
+	static IdbSyncPolicy from_uri(sqlite3_filename zName) {
+		IdbSyncPolicy sync_policy = default_policy;
+		if (const char *policy_name = sqlite3_uri_parameter(zName, "sync")) {
+			if (strcmp(policy_name, "immediate") == 0) {
+				sync_policy.policy = IDBVFS_SYNC_IMMEDIATE;
+			}
+			else if (strcmp(policy_name, "debounced") == 0) {
+				sync_policy.policy = IDBVFS_SYNC_DEBOUNCED;
+			}
+			else if (strcmp(policy_name, "manual") == 0) {
+				sync_policy.policy = IDBVFS_SYNC_MANUAL;
+			}
+		}
+		sqlite3_int64 delay_ms = sqlite3_uri_int64(zName, "sync_delay", sync_policy.delay_ms);
+		if (delay_ms >= 0 && delay_ms <= INT_MAX) {
+			sync_policy.delay_ms = delay_ms;
+		}
+		return sync_policy;
+	}
+
+	void persist() const {
+		switch (policy) {
+			case IDBVFS_SYNC_MANUAL:
+				break;
+
+			case IDBVFS_SYNC_DEBOUNCED:
+				INLINE_JS({
+					Module.idbvfsSyncfs($0);
+				}, delay_ms);
+				break;
+
+			default:
+				INLINE_JS({
+					Module.idbvfsSyncfs(0);
+				});
+				break;
+		}
+	}
+};
+
+IdbSyncPolicy IdbSyncPolicy::default_policy;
+
+/**
+ * Per database options, read from URI parameters and defaulting to the compile-time definitions.
+ *
+ * - "cache_pages": maximum number of pages kept in the page cache, 0 disables it
+ * - "layout": "flat" stores all page files in the database directory, "fanout" spreads them over subdirectories
+ * - "extent_pages": number of consecutive pages stored in each page file
+ * - "compress" and "checksums": booleans that enable page compression and page checksums
+ * - "sector_size": sector size reported to SQLite, a power of two from 32 to 65536
+ *
+ * Storage options only apply to databases created by the connection,
+ * existing ones keep the layout they were stored with.
+ */
+struct IdbFileOptions {
+	int cache_pages = IDBVFS_CACHE_PAGES;
+	int extent_pages = IDBVFS_EXTENT_PAGES;
+	uint8_t new_db_flags = (IDBVFS_COMPRESS ? IdbFileMetadata::COMPRESSED_PAGES : 0)
+		| (IDBVFS_CHECKSUMS ? IdbFileMetadata::PAGE_CHECKSUMS : 0)
+		| (IDBVFS_FANOUT_DIRECTORIES ? IdbFileMetadata::FANOUT_DIRECTORIES : 0);
+	int sector_size = DISK_SECTOR_SIZE;
+
+	/// Read options from URI parameters, ignoring invalid values
+	static IdbFileOptions from_uri(sqlite3_filename zName) {
+		IdbFileOptions options;
+		sqlite3_int64 cache_pages = sqlite3_uri_int64(zName, "cache_pages", options.cache_pages);
+		if (cache_pages >= 0 && cache_pages <= INT_MAX) {
+			options.cache_pages = cache_pages;
+		}
+		sqlite3_int64 extent_pages = sqlite3_uri_int64(zName, "extent_pages", options.extent_pages);
+		if (extent_pages >= 1 && extent_pages <= INT_MAX) {
+			options.extent_pages = extent_pages;
+		}
+		if (const char *layout = sqlite3_uri_parameter(zName, "layout")) {
+			if (strcmp(layout, "flat") == 0) {
+				options.set_flag(IdbFileMetadata::FANOUT_DIRECTORIES, false);
+			}
+			else if (strcmp(layout, "fanout") == 0) {
+				options.set_flag(IdbFileMetadata::FANOUT_DIRECTORIES, true);
+			}
+		}
+		options.set_flag(IdbFileMetadata::COMPRESSED_PAGES, sqlite3_uri_boolean(zName, "compress", options.has_flag(IdbFileMetadata::COMPRESSED_PAGES)));
+		options.set_flag(IdbFileMetadata::PAGE_CHECKSUMS, sqlite3_uri_boolean(zName, "checksums", options.has_flag(IdbFileMetadata::PAGE_CHECKSUMS)));
+		sqlite3_int64 sector_size = sqlite3_uri_int64(zName, "sector_size", options.sector_size);
+		if (sector_size >= 32 && sector_size <= 65536 && (sector_size & (sector_size - 1)) == 0) {
+			options.sector_size = sector_size;
+		}
+		return options;
+	}
+
+	bool has_flag(IdbFileMetadata::Flags flag) const {
+		return new_db_flags & flag;
+	}
+
+	void set_flag(IdbFileMetadata::Flags flag, bool value) {
+		if (value) {
+			new_db_flags |= flag;
+		}
+		else {
+			new_db_flags &= ~flag;
+		}
+	}
+};
+
+/**
+ * File state shared by all connections that open the same file.
+ *
+ * Sharing pages, journal data and WAL index memory guarantees that all
+ * connections in this process see the same contents, which WAL mode relies on.
+ * Callers must hold `mutex` while using it.
+ */
+struct IdbSharedFile {
+	std::string file_name;
+	uint32_t file_id;
+	IdbFileOptions options;
+	IdbFileHeader header;
+	IdbPageHandles pages;
+	IdbPageCache cache;
+	idbvfs_stats stats = {};
+	IdbJournal journal;
+	IdbShm shm;
+	IdbFileLock file_lock;
+	bool is_db;
+	IdbSyncPolicy sync_policy;
+	int reads_since_checksum_verification = 0;
+	/// Number of whole page reads in increasing page order up to `last_read_page`
+	int sequential_reads = 0;
+	int last_read_page = -1;
+	/// Whether `preload` was already called, so that connections opened later don't load pages again
+	bool is_preloaded = false;
+	/// Databases grow in multiples of this size, set with `SQLITE_FCNTL_CHUNK_SIZE`, 0 grows them as they are written
+	int chunk_size = 0;
+	/// Whether written pages are being staged for a batch atomic write
+	bool is_batch_atomic_write = false;
+	/// Whether a committed batch has a stored `IdbBatchRecord` whose pages are not all stored yet
+	bool has_batch_record = false;
+	sqlite3_int64 batch_atomic_write_start_size = 0;
+	std::mutex mutex;
+
+	IdbSharedFile(sqlite3_filename name, bool is_db, IdbMetadataRegistry& metadata_registry, IdbClosedFileStats& closed_file_stats, IdbCacheBudget& cache_budget)
+		: file_name(name)
+		, file_id(IdbTracer::file_id(name))
+		, options(IdbFileOptions::from_uri(name))
+		, header(file_name.c_str(), metadata_registry.get(file_name), is_db ? options.extent_pages : 1, is_db ? options.new_db_flags : 0)
+		, pages(file_name.c_str(), header.has_flag(IdbFileMetadata::FANOUT_DIRECTORIES))
+		, cache(options.cache_pages)
+		, is_db(is_db)
+		, sync_policy(IdbSyncPolicy::from_uri(name))
+		, metadata_registry(metadata_registry)
+		, closed_file_stats(closed_file_stats)
+		, cache_budget(cache_budget)
+	{
+		if (!header.get_metadata().is_supported()) {
+			// left untouched, `xOpen` refuses to open it
+			return;
+		}
+		if (is_db && header.get_page_size() == 0 && header.get() > 0 && header.get_extent_pages() == 1) {
+			// legacy headers don't store the page size, but their page files hold a single page each
+			header.set_page_size(pages.stored_size(0));
+		}
+		if (is_db && header.get_metadata().exists) {
+			if (header.has_flag(IdbFileMetadata::SNAPSHOT)) {
+				pages.set_bases(IdbSnapshotLinks::load_bases(file_name.c_str()));
+			}
+			for (const std::string& snapshot : IdbSnapshotLinks::load_snapshots(file_name.c_str())) {
+				// skip snapshots whose creation was interrupted
+				if (metadata_registry.get(snapshot).exists) {
+					pages.add_snapshot(snapshot);
+				}
+			}
+		}
+		if (is_db) {
+			replayBatchRecord();
+		}
+		// joined last, since the budget may evict pages of this cache from other threads
+		if (is_db && cache.is_enabled()) {
+			cache_budget.join(cache, mutex);
+		}
+	}
+
+	~IdbSharedFile() {
+		cache_budget.leave(cache);
+		closed_file_stats.add(stats);
+		// SQLite probes journals while databases are open, which are kept for databases that exist
+		if (is_db && !header.get_metadata().exists) {
+			metadata_registry.forget_if_probed_missing(file_name);
+			metadata_registry.forget_if_probed_missing(file_name + "-journal");
+			metadata_registry.forget_if_probed_missing(file_name + "-wal");
+		}
+	}
+
+	bool hasUnsyncedData() const {
+		return header.needs_sync() || (is_db ? cache.has_dirty_pages() : journal.has_dirty_data());
+	}
+
+	int read(void *p, int iAmt, sqlite3_int64 iOfst) {
+		IdbStats::LatencyTimer timer(stats.read_latency);
+		stats.reads++;
+		stats.bytes_read += iAmt;
+		if (iAmt + iOfst > size()) {
+			memset(p, 0, iAmt);
+			return SQLITE_IOERR_SHORT_READ;
+		}
+		return is_db ? readDb(p, iAmt, iOfst) : readJournal(p, iAmt, iOfst);
+	}
+
+	int write(const void *p, int iAmt, sqlite3_int64 iOfst) {
+		IdbStats::LatencyTimer timer(stats.write_latency);
+		stats.writes++;
+		stats.bytes_written += iAmt;
+		return is_db ? writeDb(p, iAmt, iOfst) : writeJournal(p, iAmt, iOfst);
+	}
+
+	void truncate(sqlite3_int64 new_size) {
+		sqlite3_int64 old_size = size();
+		if (is_db && new_size < old_size) {
+			// like growing, shrinking keeps the file size a multiple of the chunk size
+			new_size = std::min(roundUpToChunkSize(new_size), old_size);
+		}
+		if (is_db) {
+			cache.remove_beyond(new_size);
+		}
+		else {
+			journal.truncate(new_size);
+		}
+		removeFilesBeyond(old_size, new_size);
+		header.set(new_size);
+	}
+
+	bool sync() {
+		IdbStats::LatencyTimer timer(stats.sync_latency);
+		stats.syncs++;
+		bool success;
+		if (is_db) {
+			success = flushPages();
+		}
+		else {
+			success = journal.flush(pages);
+			header.set(size());
+		}
+		pages.close_all();
+		success = syncHeader() && success;
+		if (success) {
+			removeBatchRecord();
+		}
+		sync_policy.persist();
+		return success;
+	}
+
+	/// Load the whole database into the page cache in a single pass over its page files.
+	/// The page cache grows to hold all pages, so databases larger than `max_size` bytes
+	/// or the cache budget are loaded on demand instead.
+	void preload(sqlite3_int64 max_size) {
+		int page_size = header.get_page_size();
+		if (is_preloaded || !is_db || !cache.is_enabled() || page_size <= 0) {
+			return;
+		}
+		is_preloaded = true;
+		sqlite3_int64 page_count = size() / page_size;
+		sqlite3_int64 budget = cache_budget.get_budget();
+		if ((max_size > 0 && size() > max_size)
+			|| (budget > 0 && page_count * page_size > budget))
+		{
+			return;
+		}
+		if (page_count > (sqlite3_int64) cache.get_max_pages()) {
+			cache.set_max_pages(page_count);
+		}
+		loadIntoCache(0, page_count, page_size);
+		// no pages are dirty yet, so evicting never stores anything
+		evictPages();
+	}
+
+	/// Grow the database ahead of the writes SQLite is about to make, as told by `SQLITE_FCNTL_SIZE_HINT`,
+	/// so that the file size in its header gets updated once instead of on every sync that appends pages.
+	/// Like in SQLite's unix VFS, hints only have an effect when a chunk size is set.
+	void sizeHint(sqlite3_int64 expected_size) {
+		if (is_db && chunk_size > 0) {
+			grow(expected_size, true);
+		}
+	}
+
+	void setChunkSize(int new_chunk_size) {
+		chunk_size = std::max(new_chunk_size, 0);
+	}
+
+	// Batch atomic writes stage pages in the page cache, which never stores
+	// them while the batch is open, so the cache must be enabled.
+	bool supportsBatchAtomicWrite() const {
+		return is_db && cache.is_enabled();
+	}
+
+	int beginAtomicWrite() {
+		// store previous writes, so that only pages written in the batch are dirty
+		if (!flushPages()) {
+			return SQLITE_IOERR_WRITE;
+		}
+		// the record of a previous batch is only replaced once its pages are stored
+		if (has_batch_record) {
+			if (!syncHeader()) {
+				return SQLITE_IOERR_WRITE;
+			}
+			removeBatchRecord();
+		}
+		is_batch_atomic_write = true;
+		batch_atomic_write_start_size = header.get();
+		return SQLITE_OK;
+	}
+
+	// The batch commits when its `IdbBatchRecord` is stored. Until then pages
+	// stay staged, so that `rollbackAtomicWrite` can drop them.
+	int commitAtomicWrite() {
+		if (!IdbBatchRecord::store(file_name.c_str(), header.get(), header.get_page_size(), cache)) {
+			IdbBatchRecord::remove(file_name.c_str());
+			return SQLITE_IOERR_COMMIT_ATOMIC;
+		}
+		is_batch_atomic_write = false;
+		has_batch_record = true;
+		// pages that fail to be stored stay dirty and keep the record until a later sync stores them
+		bool success = flushPages();
+		pages.close_all();
+		if (success && syncHeader()) {
+			removeBatchRecord();
+		}
+		return SQLITE_OK;
+	}
+
+	int rollbackAtomicWrite() {
+		if (is_batch_atomic_write) {
+			is_batch_atomic_write = false;
+			cache.remove_dirty();
+			header.set(batch_atomic_write_start_size);
+		}
+		return SQLITE_OK;
+	}
+
+	/// Get a pointer to a whole page straight from the page cache.
+	/// Sets `*pp` to NULL when the page can't be fetched, so that SQLite falls back to `read`.
+	int fetch(sqlite3_int64 iOfst, int iAmt, void **pp) {
+		*pp = nullptr;
+		if (!is_db || !cache.is_enabled() || iAmt != header.get_page_size() || iOfst % iAmt != 0 || iOfst + iAmt > size()) {
+			return SQLITE_OK;
+		}
+		int page_number = iOfst / iAmt;
+		IdbPageCache::Page *page = cache.get(page_number);
+		if (page == nullptr) {
+			// readDb counts the cache miss
+			std::vector<uint8_t> data(iAmt);
+			int result = readDb(data.data(), iAmt, iOfst);
+			if (result != SQLITE_OK) {
+				return result == SQLITE_IOERR_SHORT_READ ? SQLITE_OK : result;
+			}
+			page = cache.get(page_number);
+			if (page == nullptr) {
+				return SQLITE_OK;
+			}
+		}
+		else {
+			stats.cache_hits++;
+		}
+		*pp = (void *) cache.pin(*page);
+		return SQLITE_OK;
+	}
+
+	void unfetch(void *p) {
+		if (p != nullptr) {
+			cache.unpin(p);
+		}
+	}
+
+	sqlite3_int64 size() const {
+		return journal.is_loaded() ? journal.size() : header.get();
+	}
+
+	/// Forget all contents, used when the file gets deleted while still open.
+	void reset() {
+		cache.remove_beyond(0);
+		journal.truncate(0);
+		has_batch_record = false;
+		header.reset();
+		pages.close_all();
+		pages.set_bases({});
+		pages.set_snapshots({});
+	}
+
+private:
+	IdbMetadataRegistry& metadata_registry;
+	IdbClosedFileStats& closed_file_stats;
+	IdbCacheBudget& cache_budget;
+
+	bool syncHeader() {
+		if (!header.sync()) {
+			return false;
+		}
+		metadata_registry.put(file_name, header.get_metadata());
+		return true;
+	}
+
+	void removeBatchRecord() {
+		if (has_batch_record) {
+			IdbBatchRecord::remove(file_name.c_str());
+			has_batch_record = false;
+		}
+	}
+
+	// A complete batch record means the process stopped before storing all
+	// pages of a committed batch, so they are written again.
+	void replayBatchRecord() {
+		IdbBatchRecord record;
+		if (!record.load(file_name.c_str())) {
+			IdbBatchRecord::remove(file_name.c_str());
+			return;
+		}
+		int page_size = record.get_page_size();
+		if (header.get_page_size() == 0) {
+			header.set_page_size(page_size);
+		}
+		else if (header.get_page_size() != page_size) {
+			IdbBatchRecord::remove(file_name.c_str());
+			return;
+		}
+		bool success = true;
+		for (int i = 0; i < record.get_page_count(); i++) {
+			success = writeDb(record.get_page_data(i), page_size, (sqlite3_int64) record.get_page_number(i) * page_size) == SQLITE_OK && success;
+		}
+		header.set(record.get_file_size());
+		// pages that could not be written are lost from memory, so the record is left for the next time the database is opened
+		has_batch_record = success;
+		if (success && flushPages() && syncHeader()) {
+			removeBatchRecord();
+		}
+		pages.close_all();
+	}
+
+	// Database files are stored in pages of a fixed size, so reads and
+	// writes may span several pages or only part of one.
+	int readDb(void *p, int iAmt, sqlite3_int64 iOfst) {
+		int page_size = header.get_page_size();
+		if (page_size <= 0) {
+			memset(p, 0, iAmt);
+			return SQLITE_IOERR_SHORT_READ;
+		}
+		int first_page_number = iOfst / page_size;
+		int last_page_number = (iOfst + iAmt - 1) / page_size;
+		sequential_reads = first_page_number == last_read_page + 1 ? sequential_reads + 1 : 0;
+		last_read_page = last_page_number;
+
+		bool is_short_read = false;
+		bool had_cache_miss = false;
+		uint8_t *data = (uint8_t *) p;
+		for (int page_number = first_page_number; page_number <= last_page_number; page_number++) {
+			sqlite3_int64 page_offset = (sqlite3_int64) page_number * page_size;
+			int offset_in_page = std::max<sqlite3_int64>(iOfst - page_offset, 0);
+			int amount = std::min<sqlite3_int64>(page_size - offset_in_page, iOfst + iAmt - page_offset - offset_in_page);
+			int result = readPage(page_number, data, amount, offset_in_page, had_cache_miss);
+			if (result == SQLITE_IOERR_SHORT_READ) {
+				is_short_read = true;
+			}
+			else if (result != SQLITE_OK) {
+				return result;
+			}
+			data += amount;
+		}
+
+		if (cache.is_enabled()) {
+			if (had_cache_miss && sequential_reads >= IDBVFS_READ_AHEAD_MIN_SEQUENTIAL_READS) {
+				readAhead(last_page_number + 1, page_size);
+			}
+			if (!evictPages()) {
+				return SQLITE_IOERR_READ;
+			}
+		}
+		return is_short_read ? SQLITE_IOERR_SHORT_READ : SQLITE_OK;
+	}
+
+	// Read `iAmt` bytes of a single page, loading the whole page into the page cache if enabled.
+	int readPage(int page_number, uint8_t *p, int iAmt, int offset_in_page, bool& had_cache_miss) {
+		if (IdbPageCache::Page *page = cache.get(page_number)) {
+			memcpy(p, page->data.data() + offset_in_page, iAmt);
+			stats.cache_hits++;
+			return SQLITE_OK;
+		}
+
+		int loaded_bytes;
+		if (cache.is_enabled()) {
+			stats.cache_misses++;
+			had_cache_miss = true;
+			int page_size = header.get_page_size();
+			std::vector<uint8_t> page(page_size);
+			int loaded_page_bytes = loadPage(page_number, page.data(), page_size);
+			if (loaded_page_bytes < 0) {
+				return SQLITE_IOERR_DATA;
+			}
+			memset(page.data() + loaded_page_bytes, 0, page_size - loaded_page_bytes);
+			memcpy(p, page.data() + offset_in_page, iAmt);
+			cache.put(page_number, page.data(), page_size, false);
+			loaded_bytes = std::min(std::max(loaded_page_bytes - offset_in_page, 0), iAmt);
+		}
+		else {
+			loaded_bytes = loadPage(page_number, p, iAmt, offset_in_page);
+			if (loaded_bytes < 0) {
+				return SQLITE_IOERR_DATA;
+			}
+		}
+		if (loaded_bytes < iAmt) {
+			memset(p + loaded_bytes, 0, iAmt - loaded_bytes);
+			return SQLITE_IOERR_SHORT_READ;
+		}
+		return SQLITE_OK;
+	}
+
+	// Load the pages following a sequential read into the page cache, so that
+	// scans get several pages from each page file access instead of one.
+	// Pages that can't be loaded are skipped, reading them later reports the error.
+	void readAhead(int first_page_number, int page_size) {
+		int page_count = std::min<sqlite3_int64>(IDBVFS_READ_AHEAD_PAGES, cache.get_max_pages() / 2);
+		page_count = std::min<sqlite3_int64>(page_count, size() / page_size - first_page_number);
+		loadIntoCache(first_page_number, first_page_number + page_count, page_size);
+	}
+
+	void loadIntoCache(int first_page_number, int end_page_number, int page_size) {
+		int extent_pages = header.get_extent_pages();
+		std::vector<uint8_t> data;
+		for (int page_number = first_page_number; page_number < end_page_number; ) {
+			// pages in the same page file are loaded at once
+			int file_number = page_number / extent_pages;
+			int file_end = std::min(end_page_number, (file_number + 1) * extent_pages);
+			if (hasPackedPages()) {
+				readAheadPacked(file_number, page_number, file_end, page_size);
+			}
+			else {
+				int first_slot = page_number % extent_pages;
+				data.resize((size_t) (file_end - page_number) * page_size);
+				int loaded_bytes = pages.load_into(file_number, data.data(), data.size(), (sqlite3_int64) first_slot * page_size);
+				for (int i = 0; (i + 1) * page_size <= loaded_bytes; i++) {
+					cacheReadAheadPage(page_number + i, data.data() + (size_t) i * page_size, page_size);
+				}
+			}
+			page_number = file_end;
+		}
+	}
+
+	void readAheadPacked(int file_number, int first_page_number, int end_page_number, int page_size) {
+		int extent_pages = header.get_extent_pages();
+		IdbPackedExtent extent(extent_pages);
+		if (!extent.load(pages, file_number)) {
+			return;
+		}
+		std::vector<uint8_t> page(page_size);
+		for (int page_number = first_page_number; page_number < end_page_number; page_number++) {
+			const IdbPackedExtent::Record& record = extent.get_records()[page_number % extent_pages];
+			if (record.data.empty() || (shouldVerifyChecksum() && !record.is_valid())) {
+				continue;
+			}
+			if (IdbPackedExtent::decode(record, page.data(), page_size) == page_size) {
+				cacheReadAheadPage(page_number, page.data(), page_size);
+			}
+		}
+	}
+
+	void cacheReadAheadPage(int page_number, const uint8_t *data, int page_size) {
+		// cached pages may be newer than the stored ones
+		if (cache.peek(page_number) == nullptr) {
+			cache.put(page_number, data, page_size, false);
+			stats.pages_read_ahead++;
+		}
+	}
+
+	void loadJournal() {
+		if (!journal.is_loaded()) {
+			journal.load(pages, header.get());
+		}
+	}
+
+	int readJournal(void *p, int iAmt, sqlite3_int64 iOfst) {
+		loadJournal();
+		if (!journal.read(p, iAmt, iOfst)) {
+			memset(p, 0, iAmt);
+			return SQLITE_IOERR_SHORT_READ;
+		}
+		return SQLITE_OK;
+	}
+
+	int writeDb(const void *p, int iAmt, sqlite3_int64 iOfst) {
+		if (header.get_page_size() == 0) {
+			header.set_page_size(IDBVFS_PAGE_SIZE > 0 ? IDBVFS_PAGE_SIZE : iAmt);
+		}
+		int page_size = header.get_page_size();
+		int first_page_number = iOfst / page_size;
+		int last_page_number = (iOfst + iAmt - 1) / page_size;
+
+		const uint8_t *data = (const uint8_t *) p;
+		std::vector<uint8_t> page;
+		for (int page_number = first_page_number; page_number <= last_page_number; page_number++) {
+			sqlite3_int64 page_offset = (sqlite3_int64) page_number * page_size;
+			int offset_in_page = std::max<sqlite3_int64>(iOfst - page_offset, 0);
+			int amount = std::min<sqlite3_int64>(page_size - offset_in_page, iOfst + iAmt - page_offset - offset_in_page);
+			const uint8_t *page_data = data;
+			if (amount < page_size) {
+				// partial writes modify the current page contents
+				page.assign(page_size, 0);
+				if (IdbPageCache::Page *cached_page = cache.get(page_number)) {
+					memcpy(page.data(), cached_page->data.data(), page_size);
+				}
+				else if (page_offset < size() && loadPage(page_number, page.data(), page_size) < 0) {
+					return SQLITE_IOERR_DATA;
+				}
+				memcpy(page.data() + offset_in_page, data, amount);
+				page_data = page.data();
+			}
+			stats.pages_written++;
+
+			if (cache.is_enabled()) {
+				cache.put(page_number, page_data, page_size, true);
+			}
+			else if (!storePage(page_number, page_data, page_size)) {
+				return SQLITE_IOERR_WRITE;
+			}
+			data += amount;
+		}
+
+		if (cache.is_enabled() && !evictPages()) {
+			return SQLITE_IOERR_WRITE;
+		}
+		grow(iAmt + iOfst, false);
+		return SQLITE_OK;
+	}
+
+	sqlite3_int64 roundUpToChunkSize(sqlite3_int64 new_size) const {
+		if (chunk_size <= 0) {
+			return new_size;
+		}
+		return (new_size + chunk_size - 1) / chunk_size * chunk_size;
+	}
+
+	// Pages beyond the written ones are not stored when growing ahead of
+	// writes, they read as zeros until SQLite writes them.
+	void grow(sqlite3_int64 new_size, bool is_ahead_of_writes) {
+		sqlite3_int64 chunked_size = roundUpToChunkSize(new_size);
+		if (chunked_size > size()) {
+			if (is_ahead_of_writes || chunked_size > new_size) {
+				header.set_flag(IdbFileMetadata::PREALLOCATED);
+			}
+			header.set(chunked_size);
+		}
+	}
+
+	int writeJournal(const void *p, int iAmt, sqlite3_int64 iOfst) {
+		loadJournal();
+		journal.write(p, iAmt, iOfst);
+		return SQLITE_OK;
+	}
+
+	bool hasPackedPages() const {
+		return header.has_flag(IdbFileMetadata::COMPRESSED_PAGES) || header.has_flag(IdbFileMetadata::PAGE_CHECKSUMS);
+	}
+
+	bool shouldVerifyChecksum() {
+		return IDBVFS_CHECKSUM_SAMPLING > 0 && ++reads_since_checksum_verification % IDBVFS_CHECKSUM_SAMPLING == 0;
+	}
+
+	// Pages are stored in page files of `extent_pages` consecutive pages each,
+	// so that with a single page per file the page file number is the page number.
+	// Returns -1 if the stored page is corrupt.
+	int loadPage(int page_number, void *p, int iAmt, sqlite3_int64 offset_in_page = 0) {
+		int extent_pages = header.get_extent_pages();
+		if (hasPackedPages()) {
+			return loadPackedPage(page_number / extent_pages, page_number % extent_pages, p, iAmt, offset_in_page);
+		}
+		sqlite3_int64 offset_in_extent = (sqlite3_int64) (page_number % extent_pages) * header.get_page_size() + offset_in_page;
+		return pages.load_into(page_number / extent_pages, p, iAmt, offset_in_extent);
+	}
+
+	int loadPackedPage(int file_number, int slot, void *p, int iAmt, sqlite3_int64 offset_in_page) {
+		IdbPackedExtent::Record record;
+		if (!IdbPackedExtent::load_record(pages, file_number, slot, record)) {
+			return 0;
+		}
+		if (shouldVerifyChecksum() && !record.is_valid()) {
+			return -1;
+		}
+		int page_size = header.get_page_size();
+		if (offset_in_page == 0 && iAmt >= page_size) {
+			return IdbPackedExtent::decode(record, (uint8_t *) p, iAmt);
+		}
+		std::vector<uint8_t> page(page_size);
+		int page_bytes = IdbPackedExtent::decode(record, page.data(), page.size());
+		if (page_bytes < 0) {
+			return -1;
+		}
+		int loaded_bytes = std::min<sqlite3_int64>(iAmt, std::max<sqlite3_int64>(page_bytes - offset_in_page, 0));
+		memcpy(p, page.data() + offset_in_page, loaded_bytes);
+		return loaded_bytes;
+	}
+
+	// Store `page_count` consecutive pages that live in the same page file.
+	bool storePages(int first_page_number, int page_count, const void *p, int page_size) {
+		if (hasPackedPages()) {
+			std::vector<std::pair<int, const uint8_t *>> run;
+			for (int i = 0; i < page_count; i++) {
+				run.emplace_back(first_page_number + i, (const uint8_t *) p + i * page_size);
+			}
+			return storePackedPages(run, page_size);
+		}
+		int extent_pages = header.get_extent_pages();
+		sqlite3_int64 offset_in_extent = (sqlite3_int64) (first_page_number % extent_pages) * page_size;
+		int stored_bytes = pages.store(first_page_number / extent_pages, p, page_count * page_size, offset_in_extent);
+		stats.pages_flushed += page_count;
+		return stored_bytes == page_count * page_size;
+	}
+
+	bool storePage(int page_number, const void *p, int iAmt) {
+		return storePages(page_number, 1, p, iAmt);
+	}
+
+	// Packed extents are rewritten whole, so `run` may have any pages of the same page file.
+	bool storePackedPages(const std::vector<std::pair<int, const uint8_t *>>& run, int page_size) {
+		int extent_pages = header.get_extent_pages();
+		int file_number = run.front().first / extent_pages;
+		IdbPackedExtent extent(extent_pages);
+		if (extent_pages > 1 && !extent.load(pages, file_number)) {
+			return false;
+		}
+		bool compress = header.has_flag(IdbFileMetadata::COMPRESSED_PAGES);
+		for (const auto& page : run) {
+			extent.set_page(page.first % extent_pages, page.second, page_size, compress);
+		}
+		stats.pages_flushed += run.size();
+		return extent.store(pages, file_number);
+	}
+
+	// Remove page files that only hold data beyond `new_size` and shrink
+	// the last extent, so that storage shrinks along with the file.
+	void removeFilesBeyond(sqlite3_int64 old_size, sqlite3_int64 new_size) {
+		int page_size = header.get_page_size();
+		int extent_pages = header.get_extent_pages();
+		sqlite3_int64 bytes_per_file = is_db ? (sqlite3_int64) page_size * extent_pages : IDBVFS_JOURNAL_CHUNK_SIZE;
+		if (bytes_per_file <= 0) {
+			return;
+		}
+		int old_file_count = (old_size + bytes_per_file - 1) / bytes_per_file;
+		int new_file_count = (new_size + bytes_per_file - 1) / bytes_per_file;
+		for (int i = new_file_count; i < old_file_count; i++) {
+			pages.remove(i);
+		}
+		if (is_db && new_file_count > 0 && new_size % bytes_per_file != 0) {
+			sqlite3_int64 last_file_size = new_size - (new_file_count - 1) * bytes_per_file;
+			if (hasPackedPages()) {
+				IdbPackedExtent extent(extent_pages);
+				if (extent.load(pages, new_file_count - 1)) {
+					extent.clear_from((last_file_size + page_size - 1) / page_size);
+					extent.store(pages, new_file_count - 1);
+				}
+			}
+			else {
+				pages.truncate(new_file_count - 1, last_file_size);
+			}
+		}
+	}
+
+	bool evictPages() {
+		while (cache.is_over_capacity()) {
+			if (cache.is_full_of_dirty_pages()) {
+				if (is_batch_atomic_write) {
+					// staged pages can only be stored on commit, let the cache grow until then
+					break;
+				}
+				if (!flushPages()) {
+					return false;
+				}
+			}
+			if (!cache.remove_least_recently_used_clean()) {
+				// every page is pinned by `xFetch`, let the cache grow until they are released
+				break;
+			}
+		}
+		cache_budget.reclaim(&cache);
+		return true;
+	}
+
+	// Store all dirty pages in page order, coalescing consecutive pages
+	// in the same page file into a single write.
+	// Packed extents are rewritten whole, so all their dirty pages are coalesced.
+	bool flushPages() {
+		int extent_pages = header.get_extent_pages();
+		bool is_packed = hasPackedPages();
+		std::vector<IdbPageCache::Page *> run;
+		std::vector<uint8_t> run_data;
+		auto flush_run = [&]() {
+			if (run.empty()) {
+				return true;
+			}
+			int page_size = run.front()->data.size();
+			bool success;
+			if (is_packed) {
+				std::vector<std::pair<int, const uint8_t *>> packed_run;
+				for (IdbPageCache::Page *page : run) {
+					packed_run.emplace_back(page->page_number, page->data.data());
+				}
+				success = storePackedPages(packed_run, page_size);
+			}
+			else {
+				const void *data = run.front()->data.data();
+				if (run.size() > 1) {
+					run_data.clear();
+					for (IdbPageCache::Page *page : run) {
+						run_data.insert(run_data.end(), page->data.begin(), page->data.end());
+					}
+					data = run_data.data();
+				}
+				success = storePages(run.front()->page_number, run.size(), data, page_size);
+			}
+			if (!success) {
+				return false;
+			}
+			for (IdbPageCache::Page *page : run) {
+				cache.mark_clean(*page);
+			}
+			run.clear();
+			return true;
+		};
+
+		// copy page numbers, since flushing runs changes the dirty page set
+		std::vector<int> dirty_pages(cache.get_dirty_pages().begin(), cache.get_dirty_pages().end());
+		for (int page_number : dirty_pages) {
+			IdbPageCache::Page *page = cache.peek(page_number);
+			if (!run.empty()) {
+				const IdbPageCache::Page *last = run.back();
+				bool is_consecutive = (is_packed || page_number == last->page_number + 1)
+					&& page_number / extent_pages == last->page_number / extent_pages;
+				if (!is_consecutive && !flush_run()) {
+					return false;
+				}
+			}
+			run.push_back(page);
+		}
+		return flush_run();
+	}
+};
+
+struct IdbFile : public SQLiteFileImpl {
+	std::shared_ptr<IdbSharedFile> file;
+	IdbShm::Locks shm_locks = {};
+	int lock_level = SQLITE_LOCK_NONE;
+	bool is_shm_mapped = false;
+	bool is_wal = false;
+
+	IdbFile() {}
+	IdbFile(std::shared_ptr<IdbSharedFile> file, bool is_wal) : file(file), is_wal(is_wal) {}
+
+	int iVersion() const override {
+		return 3;
+	}
+
+	int xClose() override {
+		IdbTracer::Scope trace(IDBVFS_TRACE_CLOSE, file->file_id);
+		if (is_shm_mapped) {
+			xShmUnmap(0);
+		}
+		std::lock_guard<std::mutex> lock(file->mutex);
+		file->file_lock.unlock(lock_level, SQLITE_LOCK_NONE);
+		// persist writes that were never synced, e.g. when using "PRAGMA synchronous=OFF"
+		bool success = true;
+		if ((file->is_db || is_wal) && file->hasUnsyncedData()) {
+			success = file->sync();
+		}
+		file->pages.close_all();
+		return trace.finish(success ? SQLITE_OK : SQLITE_IOERR_CLOSE);
+	}
+
+	int xRead(void *p, int iAmt, sqlite3_int64 iOfst) override {
+		IdbTracer::Scope trace(IDBVFS_TRACE_READ, file->file_id, iOfst, iAmt);
+		std::lock_guard<std::mutex> lock(file->mutex);
+		return trace.finish(file->read(p, iAmt, iOfst));
+	}
+
+	int xWrite(const void *p, int iAmt, sqlite3_int64 iOfst) override {
+		IdbTracer::Scope trace(IDBVFS_TRACE_WRITE, file->file_id, iOfst, iAmt);
+		std::lock_guard<std::mutex> lock(file->mutex);
+		return trace.finish(file->write(p, iAmt, iOfst));
+	}
+
+	int xTruncate(sqlite3_int64 size) override {
+		IdbTracer::Scope trace(IDBVFS_TRACE_TRUNCATE, file->file_id, size);
+		std::lock_guard<std::mutex> lock(file->mutex);
+		file->truncate(size);
+		return SQLITE_OK;
+	}
+
+	int xSync(int flags) override {
+		IdbTracer::Scope trace(IDBVFS_TRACE_SYNC, file->file_id, 0, flags);
+		std::lock_guard<std::mutex> lock(file->mutex);
+		bool success = file->sync();
+		return trace.finish(success ? SQLITE_OK : SQLITE_IOERR_FSYNC);
+	}
+
+	int xFileSize(sqlite3_int64 *pSize) override {
+		IdbTracer::Scope trace(IDBVFS_TRACE_FILE_SIZE, file->file_id);
+		std::lock_guard<std::mutex> lock(file->mutex);
+		*pSize = file->size();
+		trace.set_offset(*pSize);
+		return SQLITE_OK;
+	}
+
+	int xLock(int flags) override {
+		std::lock_guard<std::mutex> lock(file->mutex);
+		return file->file_lock.lock(lock_level, flags);
+	}
+
+	int xUnlock(int flags) override {
+		std::lock_guard<std::mutex> lock(file->mutex);
+		file->file_lock.unlock(lock_level, flags);
+		return SQLITE_OK;
+	}
+
+	int xCheckReservedLock(int *pResOut) override {
+		std::lock_guard<std::mutex> lock(file->mutex);
+		*pResOut = file->file_lock.has_reserved();
+		return SQLITE_OK;
+	}
+
+	int xFileControl(int op, void *pArg) override {
+		switch (op) {
+			case SQLITE_FCNTL_VFSNAME:
+				*(char **) pArg = sqlite3_mprintf("%z", IDBVFS_NAME);
+				return SQLITE_OK;
+
+			case SQLITE_FCNTL_BEGIN_ATOMIC_WRITE: {
+				IdbTracer::Scope trace(IDBVFS_TRACE_BEGIN_ATOMIC_WRITE, file->file_id);
+				std::lock_guard<std::mutex> lock(file->mutex);
+				return trace.finish(file->beginAtomicWrite());
+			}
+
+			case SQLITE_FCNTL_COMMIT_ATOMIC_WRITE: {
+				IdbTracer::Scope trace(IDBVFS_TRACE_COMMIT_ATOMIC_WRITE, file->file_id);
+				std::lock_guard<std::mutex> lock(file->mutex);
+				return trace.finish(file->commitAtomicWrite());
+			}
+
+			case SQLITE_FCNTL_ROLLBACK_ATOMIC_WRITE: {
+				IdbTracer::Scope trace(IDBVFS_TRACE_ROLLBACK_ATOMIC_WRITE, file->file_id);
+				std::lock_guard<std::mutex> lock(file->mutex);
+				return trace.finish(file->rollbackAtomicWrite());
+			}
+
+			case SQLITE_FCNTL_SIZE_HINT: {
+				std::lock_guard<std::mutex> lock(file->mutex);
+				file->sizeHint(*(sqlite3_int64 *) pArg);
+				return SQLITE_OK;
+			}
+
+			case SQLITE_FCNTL_CHUNK_SIZE: {
+				std::lock_guard<std::mutex> lock(file->mutex);
+				file->setChunkSize(*(int *) pArg);
+				return SQLITE_OK;
+			}
+
+			case IDBVFS_FCNTL_STATS: {
+				std::lock_guard<std::mutex> lock(file->mutex);
+				*(idbvfs_stats *) pArg = file->stats;
+				return SQLITE_OK;
+			}
+		}
+		return SQLITE_NOTFOUND;
+	}
+
+	int xSectorSize() override {
+		return file->options.sector_size;
+	}
+
+	int xDeviceCharacteristics() override {
+		// page and journal data are always stored before the file size is updated
+		int characteristics = SQLITE_IOCAP_SAFE_APPEND;
+		if (file->supportsBatchAtomicWrite()) {
+			characteristics |= SQLITE_IOCAP_BATCH_ATOMIC;
+		}
+		return characteristics;
+	}
+
+	int xShmMap(int iPg, int pgsz, int flags, void volatile **pp) override {
+		IdbTracer::Scope trace(IDBVFS_TRACE_SHM_MAP, file->file_id, iPg, pgsz);
+		std::lock_guard<std::mutex> lock(file->mutex);
+		if (!is_shm_mapped) {
+			file->shm.users++;
+			is_shm_mapped = true;
+		}
+		return trace.finish(file->shm.map(iPg, pgsz, flags, pp));
+	}
+
+	int xShmLock(int offset, int n, int flags) override {
+		std::lock_guard<std::mutex> lock(file->mutex);
+		return file->shm.lock(shm_locks, offset, n, flags);
+	}
+
+	void xShmBarrier() override {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	int xShmUnmap(int deleteFlag) override {
+		IdbTracer::Scope trace(IDBVFS_TRACE_SHM_UNMAP, file->file_id, 0, deleteFlag);
+		std::lock_guard<std::mutex> lock(file->mutex);
+		file->shm.lock(shm_locks, 0, SQLITE_SHM_NLOCK, SQLITE_SHM_UNLOCK);
+		if (is_shm_mapped) {
+			is_shm_mapped = false;
+			if (--file->shm.users == 0) {
+				file->shm.unmap();
+			}
+		}
+		return SQLITE_OK;
+	}
+
+	int xFetch(sqlite3_int64 iOfst, int iAmt, void **pp) override {
+		IdbTracer::Scope trace(IDBVFS_TRACE_FETCH, file->file_id, iOfst, iAmt);
+		std::lock_guard<std::mutex> lock(file->mutex);
+		return trace.finish(file->fetch(iOfst, iAmt, pp));
+	}
+
+	int xUnfetch(sqlite3_int64 iOfst, void *p) override {
+		IdbTracer::Scope trace(IDBVFS_TRACE_UNFETCH, file->file_id, iOfst);
+		std::lock_guard<std::mutex> lock(file->mutex);
+		file->unfetch(p);
+		return SQLITE_OK;
+	}
+};
+
+struct IdbVfs : public SQLiteVfsImpl<IdbFile> {
+	int xOpen(sqlite3_filename zName, SQLiteFile<IdbFile> *file, int flags, int *pOutFlags) override {
+		IdbTracer::Scope trace(IDBVFS_TRACE_OPEN, IdbTracer::file_id(zName), 0, flags);
+		if (zName == nullptr) {
+			// Anonymous temporary files have no storage path, use `PRAGMA temp_store=MEMORY` instead
+			return trace.finish(SQLITE_CANTOPEN);
+		}
+		bool is_db = (flags & SQLITE_OPEN_MAIN_DB) || (flags & SQLITE_OPEN_TEMP_DB);
+		bool is_wal = flags & SQLITE_OPEN_WAL;
+		std::shared_ptr<IdbSharedFile> shared_file = openSharedFile(zName, is_db);
+		{
+			std::lock_guard<std::mutex> lock(shared_file->mutex);
+			if (!shared_file->header.get_metadata().is_supported()) {
+				// written by a newer version of idbvfs, whose layout could be misread
+				return trace.finish(SQLITE_CANTOPEN);
+			}
+			if ((flags & SQLITE_OPEN_MAIN_DB) && sqlite3_uri_boolean(zName, "preload", 0)) {
+				shared_file->preload(sqlite3_uri_int64(zName, "preload_max_size", IDBVFS_PRELOAD_MAX_SIZE));
+			}
+		}
+		file->implementation = IdbFile(shared_file, is_wal);
+		return SQLITE_OK;
+	}
+
+	int xDelete(const char *zName, int syncDir) override {
+		IdbTracer::Scope trace(IDBVFS_TRACE_DELETE, IdbTracer::file_id(zName));
+		if (std::shared_ptr<IdbSharedFile> open_file = findSharedFile(zName)) {
+			std::lock_guard<std::mutex> lock(open_file->mutex);
+			open_file->reset();
+		}
+
+		IdbFileHeader header(zName, metadata_registry.get(zName));
+		IdbPageHandles pages(zName, header.has_flag(IdbFileMetadata::FANOUT_DIRECTORIES));
+		int file_count = header.get_file_count();
+		if (file_count < 0) {
+			file_count = countPageFiles(pages, header.get());
+		}
+		// only databases, which have a page size, take part in snapshots
+		if (header.get_page_size() > 0) {
+			if (!detachSnapshots(zName, header)) {
+				return trace.finish(SQLITE_IOERR_DELETE);
+			}
+			if (header.has_flag(IdbFileMetadata::SNAPSHOT)) {
+				detachFromSource(zName);
+			}
+		}
+		metadata_registry.remove(zName);
+		if (!header.remove()) {
+			return trace.finish(SQLITE_IOERR_DELETE);
+		}
+
+		for (int i = 0; i < file_count; i++) {
+			pages.remove(i);
+		}
+		IdbPage(zName, IDBVFS_SNAPSHOT_OF_KEY).remove();
+		IdbPage(zName, IDBVFS_SNAPSHOTS_KEY).remove();
+		IdbPage(zName, IDBVFS_BATCH_KEY).remove();
+		if (rmdir(zName) != 0 && errno == ENOTEMPTY) {
+			// page files left behind by versions that didn't remove them on truncate
+			removeDirectoryContents(zName);
+			rmdir(zName);
+		}
+		return SQLITE_OK;
+	}
+
+	int xAccess(const char *zName, int flags, int *pResOut) override {
+		IdbTracer::Scope trace(IDBVFS_TRACE_ACCESS, IdbTracer::file_id(zName), 0, flags);
+		switch (flags) {
+			case SQLITE_ACCESS_EXISTS:
+			case SQLITE_ACCESS_READWRITE:
+			case SQLITE_ACCESS_READ:
+				// files that are open may not have been synced yet
+				*pResOut = findSharedFile(zName) != nullptr || metadata_registry.get(zName).exists;
+				trace.set_offset(*pResOut);
+				return SQLITE_OK;
+		}
+		return trace.finish(SQLITE_NOTFOUND);
+	}
+
+#ifdef __EMSCRIPTEN__
+	int xFullPathname(const char *zName, int nOut, char *zOut) override {
+		if (zName[0] == '/') {
+			strncpy(zOut, zName, nOut);
+		}
+		else {
+			snprintf(zOut, nOut, "/idbfs/%s", zName);
+		}
+		return SQLITE_OK;
+	}
+#endif
+
+	/// Check the stored checksum of every page without decoding them.
+	/// Pages with a mismatching checksum or missing from storage are counted as corrupt,
+	/// except for missing pages at the end of databases that grew ahead of their writes.
+	int verifyChecksums(const char *zName, long long *corrupt_pages) {
+		std::shared_ptr<IdbSharedFile> open_file = findSharedFile(zName);
+		std::unique_lock<std::mutex> lock;
+		if (open_file) {
+			lock = std::unique_lock<std::mutex>(open_file->mutex);
+		}
+
+		IdbFileHeader header(zName, metadata_registry.get(zName));
+		const IdbFileMetadata& metadata = header.get_metadata();
+		if (!metadata.exists || (!header.has_flag(IdbFileMetadata::PAGE_CHECKSUMS) && !header.has_flag(IdbFileMetadata::COMPRESSED_PAGES))) {
+			return SQLITE_NOTFOUND;
+		}
+		if (!metadata.is_supported()) {
+			return SQLITE_CANTOPEN;
+		}
+
+		IdbPageHandles pages(zName, header.has_flag(IdbFileMetadata::FANOUT_DIRECTORIES));
+		if (header.has_flag(IdbFileMetadata::SNAPSHOT)) {
+			pages.set_bases(IdbSnapshotLinks::load_bases(zName));
+		}
+		long long corrupt = 0;
+		long long missing = 0;
+		int extent_pages = header.get_extent_pages();
+		int file_count = header.get_file_count();
+		for (int file_number = 0; file_number < file_count; file_number++) {
+			IdbPackedExtent extent(extent_pages);
+			extent.load(pages, file_number);
+			const std::vector<IdbPackedExtent::Record>& records = extent.get_records();
+			for (int slot = 0; slot < extent_pages; slot++) {
+				sqlite3_int64 page_number = (sqlite3_int64) file_number * extent_pages + slot;
+				if (page_number >= (sqlite3_int64) metadata.page_count) {
+					break;
+				}
+				if (records[slot].data.empty()) {
+					missing++;
+				}
+				else {
+					// only pages missing before a stored one can't have been preallocated
+					corrupt += missing + !records[slot].is_valid();
+					missing = 0;
+				}
+			}
+		}
+		if (!header.has_flag(IdbFileMetadata::PREALLOCATED)) {
+			corrupt += missing;
+		}
+		pages.close_all();
+
+		if (corrupt_pages) {
+			*corrupt_pages = corrupt;
+		}
+		return corrupt > 0 ? SQLITE_IOERR_DATA : SQLITE_OK;
+	}
+
+	/// Create a copy-on-write snapshot of a database, see `IdbPageHandles`.
+	int snapshot(const char *source_name, const char *snapshot_name) {
+		if (strcmp(source_name, snapshot_name) == 0) {
+			return SQLITE_MISUSE;
+		}
+		if (findSharedFile(snapshot_name) != nullptr || metadata_registry.get(snapshot_name).exists) {
+			return SQLITE_CANTOPEN;
+		}
+		// data in the WAL file is not part of the snapshot, so it must be checkpointed first
+		std::string wal_name = std::string(source_name) + "-wal";
+		if (std::shared_ptr<IdbSharedFile> open_wal = findSharedFile(wal_name.c_str())) {
+			std::lock_guard<std::mutex> lock(open_wal->mutex);
+			if (open_wal->size() > 0) {
+				return SQLITE_BUSY;
+			}
+		}
+		else if (metadata_registry.get(wal_name).file_size > 0) {
+			return SQLITE_BUSY;
+		}
+
+		std::shared_ptr<IdbSharedFile> open_source = findSharedFile(source_name);
+		std::unique_lock<std::mutex> lock;
+		IdbFileMetadata metadata;
+		if (open_source) {
+			lock = std::unique_lock<std::mutex>(open_source->mutex);
+			if (!open_source->is_db) {
+				return SQLITE_NOTFOUND;
+			}
+			if (open_source->file_lock.has_reserved()) {
+				return SQLITE_BUSY;
+			}
+			if (!open_source->sync()) {
+				return SQLITE_IOERR_FSYNC;
+			}
+			metadata = open_source->header.get_metadata();
+		}
+		else {
+			metadata = metadata_registry.get(source_name);
+			if (metadata.exists && metadata.page_size == 0 && metadata.extent_pages == 1) {
+				// legacy headers don't store the page size, but their page files hold a single page each
+				metadata.page_size = IdbPageHandles(source_name).stored_size(0);
+			}
+		}
+		if (!metadata.exists) {
+			return SQLITE_NOTFOUND;
+		}
+		if ((metadata.page_size == 0 && metadata.file_size > 0) || !metadata.is_supported()) {
+			return SQLITE_CANTOPEN;
+		}
+
+		// register the snapshot before it exists, so that the source never changes files it shares
+		std::vector<std::string> snapshots = IdbSnapshotLinks::load_snapshots(source_name);
+		snapshots.push_back(snapshot_name);
+		if (!IdbSnapshotLinks::store_snapshots(source_name, snapshots)) {
+			return SQLITE_IOERR_WRITE;
+		}
+		if (open_source) {
+			open_source->pages.add_snapshot(snapshot_name);
+		}
+		if (IdbPage(snapshot_name, IDBVFS_SNAPSHOT_OF_KEY).store(source_name) < (int) strlen(source_name)) {
+			return SQLITE_IOERR_WRITE;
+		}
+		metadata.flags |= IdbFileMetadata::SNAPSHOT;
+		IdbFileHeader header(snapshot_name, IdbFileMetadata());
+		header.copy_from(metadata);
+		if (!header.sync()) {
+			return SQLITE_IOERR_WRITE;
+		}
+		metadata_registry.put(snapshot_name, header.get_metadata());
+		(open_source ? open_source->sync_policy : IdbSyncPolicy::default_policy).persist();
+		return SQLITE_OK;
+	}
+
+	/// Get the statistics of an open file, or of all files opened by the VFS if `zName` is NULL.
+	int getStats(const char *zName, idbvfs_stats *stats) {
+		if (zName != nullptr) {
+			std::shared_ptr<IdbSharedFile> open_file = findSharedFile(zName);
+			if (!open_file) {
+				return SQLITE_NOTFOUND;
+			}
+			std::lock_guard<std::mutex> lock(open_file->mutex);
+			*stats = open_file->stats;
+			return SQLITE_OK;
+		}
+
+		std::vector<std::shared_ptr<IdbSharedFile>> files;
+		{
+			std::lock_guard<std::mutex> lock(open_files_mutex);
+			for (const auto& entry : open_files) {
+				if (std::shared_ptr<IdbSharedFile> open_file = entry.second.lock()) {
+					files.push_back(open_file);
+				}
+			}
+		}
+		*stats = closed_file_stats.get();
+		for (const std::shared_ptr<IdbSharedFile>& open_file : files) {
+			std::lock_guard<std::mutex> lock(open_file->mutex);
+			IdbStats::add(*stats, open_file->stats);
+		}
+		return SQLITE_OK;
+	}
+
+	/// Budget shared by the page caches of all open files
+	IdbCacheBudget cache_budget;
+
+private:
+	// Legacy headers have no page count, but every page file except the last one
+	// is full, so the size of the first one tells how many files hold `size` bytes.
+	static int countPageFiles(IdbPageHandles& pages, sqlite3_int64 size) {
+		sqlite3_int64 bytes_per_file = pages.stored_size(0);
+		if (bytes_per_file <= 0) {
+			return 0;
+		}
+		return (size + bytes_per_file - 1) / bytes_per_file;
+	}
+
+	// Snapshots of a database that is being deleted get a copy of every page file they still share with it
+	bool detachSnapshots(const char *zName, const IdbFileHeader& header) {
+		std::vector<std::string> snapshots;
+		for (const std::string& snapshot : IdbSnapshotLinks::load_snapshots(zName)) {
+			if (metadata_registry.get(snapshot).exists) {
+				snapshots.push_back(snapshot);
+			}
+		}
+		if (snapshots.empty()) {
+			return true;
+		}
+		IdbPageHandles pages(zName, header.has_flag(IdbFileMetadata::FANOUT_DIRECTORIES));
+		if (header.has_flag(IdbFileMetadata::SNAPSHOT)) {
+			pages.set_bases(IdbSnapshotLinks::load_bases(zName));
+		}
+		pages.set_snapshots(snapshots);
+		int file_count = header.get_file_count();
+		for (int i = 0; i < file_count; i++) {
+			if (!pages.preserve(i)) {
+				return false;
+			}
+		}
+		pages.close_all();
+		for (const std::string& snapshot : snapshots) {
+			IdbPage(snapshot.c_str(), IDBVFS_SNAPSHOT_OF_KEY).remove();
+			if (std::shared_ptr<IdbSharedFile> open_snapshot = findSharedFile(snapshot.c_str())) {
+				std::lock_guard<std::mutex> lock(open_snapshot->mutex);
+				open_snapshot->pages.set_bases({});
+			}
+		}
+		return true;
+	}
+
+	void detachFromSource(const char *zName) {
+		std::string source_name = IdbSnapshotLinks::load_source(zName);
+		if (source_name.empty()) {
+			return;
+		}
+		std::vector<std::string> snapshots = IdbSnapshotLinks::load_snapshots(source_name.c_str());
+		snapshots.erase(std::remove(snapshots.begin(), snapshots.end(), zName), snapshots.end());
+		IdbSnapshotLinks::store_snapshots(source_name.c_str(), snapshots);
+		if (std::shared_ptr<IdbSharedFile> open_source = findSharedFile(source_name.c_str())) {
+			std::lock_guard<std::mutex> lock(open_source->mutex);
+			open_source->pages.remove_snapshot(zName);
+		}
+	}
+
+	static void removeDirectoryContents(const char *zName) {
+		DIR *dir = opendir(zName);
+		if (dir == nullptr) {
+			return;
+		}
+		std::vector<std::string> entries;
+		while (struct dirent *entry = readdir(dir)) {
+			if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+				entries.push_back(entry->d_name);
+			}
+		}
+		closedir(dir);
+		for (const std::string& entry : entries) {
+			if (!IdbPage(zName, entry.c_str()).remove() && (errno == EISDIR || errno == EPERM)) {
+				// subdirectories of the fan-out layout
+				std::string path = std::string(zName) + "/" + entry;
+				removeDirectoryContents(path.c_str());
+				rmdir(path.c_str());
+			}
+		}
+	}
+
+	std::shared_ptr<IdbSharedFile> openSharedFile(sqlite3_filename zName, bool is_db) {
+		std::lock_guard<std::mutex> lock(open_files_mutex);
+		std::weak_ptr<IdbSharedFile>& entry = open_files[zName];
+		std::shared_ptr<IdbSharedFile> shared_file = entry.lock();
+		if (!shared_file) {
+			shared_file = std::make_shared<IdbSharedFile>(zName, is_db, metadata_registry, closed_file_stats, cache_budget);
+			entry = shared_file;
+		}
+		return shared_file;
+	}
+
+	std::shared_ptr<IdbSharedFile> findSharedFile(const char *zName) {
+		std::lock_guard<std::mutex> lock(open_files_mutex);
+		auto it = open_files.find(zName);
+		if (it == open_files.end()) {
+			return nullptr;
+		}
+		std::shared_ptr<IdbSharedFile> shared_file = it->second.lock();
+		if (!shared_file) {
+			open_files.erase(it);
+		}
+		return shared_file;
+	}
+
+	/// Files currently open by any connection, keyed by file name
+	std::unordered_map<std::string, std::weak_ptr<IdbSharedFile>> open_files;
+	std::mutex open_files_mutex;
+	IdbMetadataRegistry metadata_registry;
+	IdbClosedFileStats closed_file_stats;
+};
+
+extern "C" {
 	const char *IDBVFS_NAME = "idbvfs";
 
-	int idbvfs_register(int makeDefault) {
+	static SQLiteVfs<IdbVfs>& get_idbvfs() {
 		static SQLiteVfs<IdbVfs> idbvfs(IDBVFS_NAME);
+		return idbvfs;
+	}
+
+	int idbvfs_register(int makeDefault) {
+		SQLiteVfs<IdbVfs>& idbvfs = get_idbvfs();
 		INLINE_JS({
 			if (!Module.idbvfsSyncfs) {
 				// Run FS.syncfs in a queue, to avoid concurrent execution errors
 				var syncQueue = 0;
+				var syncTimeout = null;
 				function doSync() {
 					FS.syncfs(false, function() {
 						syncQueue--;
@@ -452,14 +3579,141 @@ extern "C" {
 						}
 					});
 				}
-				Module.idbvfsSyncfs = function() {
+				function queueSync() {
 					syncQueue++;
 					if (syncQueue == 1) {
 						doSync();
 					}
+				}
+				// Syncs requested with a delay are coalesced into the one already scheduled
+				Module.idbvfsSyncfs = function(delay) {
+					if (delay > 0) {
+						if (syncTimeout === null) {
+							syncTimeout = setTimeout(function() {
+								syncTimeout = null;
+								queueSync();
+							}, delay);
+						}
+						return;
+					}
+					if (syncTimeout !== null) {
+						clearTimeout(syncTimeout);
+						syncTimeout = null;
+					}
+					queueSync();
 				};
 			}
 		});
 		return idbvfs.register_vfs(makeDefault);
 	}
+
+	int idbvfs_set_sync_policy(int policy, int delay_ms) {
+		if (!IdbSyncPolicy::is_valid(policy, delay_ms)) {
+			return SQLITE_MISUSE;
+		}
+		IdbSyncPolicy::default_policy.policy = policy;
+		IdbSyncPolicy::default_policy.delay_ms = delay_ms;
+		return SQLITE_OK;
+	}
+
+	int idbvfs_flush(void) {
+		INLINE_JS({
+			if (Module.idbvfsSyncfs) {
+				Module.idbvfsSyncfs(0);
+			}
+		});
+		return SQLITE_OK;
+	}
+
+	// Files are keyed by their full path name, like the ones SQLite passes to xOpen
+	static int get_full_pathname(const char *filename, std::vector<char>& full_path) {
+		SQLiteVfs<IdbVfs>& idbvfs = get_idbvfs();
+		full_path.resize(idbvfs.mxPathname + 1);
+		return idbvfs.xFullPathname(&idbvfs, filename, full_path.size(), full_path.data());
+	}
+
+	int idbvfs_verify_checksums(const char *filename, long long *corrupt_pages) {
+		if (filename == nullptr) {
+			return SQLITE_MISUSE;
+		}
+		std::vector<char> full_path;
+		int result = get_full_pathname(filename, full_path);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		return get_idbvfs().implementation.verifyChecksums(full_path.data(), corrupt_pages);
+	}
+
+	int idbvfs_snapshot(const char *source, const char *snapshot) {
+		if (source == nullptr || snapshot == nullptr) {
+			return SQLITE_MISUSE;
+		}
+		std::vector<char> source_path, snapshot_path;
+		int result = get_full_pathname(source, source_path);
+		if (result == SQLITE_OK) {
+			result = get_full_pathname(snapshot, snapshot_path);
+		}
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		return get_idbvfs().implementation.snapshot(source_path.data(), snapshot_path.data());
+	}
+
+	long long idbvfs_cache_budget(long long bytes) {
+		IdbCacheBudget& cache_budget = get_idbvfs().implementation.cache_budget;
+		long long previous_bytes = cache_budget.get_budget();
+		if (bytes >= 0) {
+			cache_budget.set_budget(bytes);
+			cache_budget.reclaim();
+		}
+		return previous_bytes;
+	}
+
+	long long idbvfs_cache_used(void) {
+		return get_idbvfs().implementation.cache_budget.get_used();
+	}
+
+	int idbvfs_release_memory(int bytes) {
+		if (bytes <= 0) {
+			return 0;
+		}
+		return get_idbvfs().implementation.cache_budget.release(bytes);
+	}
+
+	int idbvfs_trace_enable(int enable) {
+		return IdbTracer::enable(enable) ? SQLITE_OK : SQLITE_NOMEM;
+	}
+
+	int idbvfs_trace_drain(idbvfs_trace_event *events, int max_events, long long *dropped_events) {
+		if (events == nullptr && max_events > 0) {
+			return -1;
+		}
+		return IdbTracer::drain(events, max_events, dropped_events);
+	}
+
+	unsigned int idbvfs_trace_file_id(const char *filename) {
+		if (filename == nullptr) {
+			return IdbTracer::file_id(nullptr);
+		}
+		std::vector<char> full_path;
+		if (get_full_pathname(filename, full_path) != SQLITE_OK) {
+			return IdbTracer::file_id(filename);
+		}
+		return IdbTracer::file_id(full_path.data());
+	}
+
+	int idbvfs_get_stats(const char *filename, idbvfs_stats *stats) {
+		if (stats == nullptr) {
+			return SQLITE_MISUSE;
+		}
+		if (filename == nullptr) {
+			return get_idbvfs().implementation.getStats(nullptr, stats);
+		}
+		std::vector<char> full_path;
+		int result = get_full_pathname(filename, full_path);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+		return get_idbvfs().implementation.getStats(full_path.data(), stats);
+	}
 }
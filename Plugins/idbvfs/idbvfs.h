@@ -1,6 +1,16 @@
 /** @file idbvfs.h
  *
  * SQLite VFS that stores data in web browser's Indexed DB using Emscripten.
+ *
+ * Databases opened with URI file names accept these parameters,
+ * which override the compile-time definitions for each database:
+ * - "cache_pages": maximum number of pages kept in memory, 0 disables the page cache.
+ * - "sync" and "sync_delay": sync policy, see `idbvfs_sync_policy`.
+ * - "preload" and "preload_max_size": load the whole database into memory when it is opened, if it is not larger than the maximum size.
+ * - "sector_size": sector size reported to SQLite.
+ * - "layout", "extent_pages", "compress" and "checksums": storage options of new databases.
+ *   Layouts are "flat", with all page files in the database directory, or "fanout", spreading them over subdirectories.
+ * @see https://sqlite.org/uri.html
  */
 /*
  * This is free and unencumbered software released into the public domain.
@@ -37,6 +47,56 @@ extern "C" {
  */
 extern const char *IDBVFS_NAME;
 
+/**
+ * File control opcode for getting I/O statistics of an idbvfs database file.
+ *
+ * Usage: `sqlite3_file_control(db, "main", IDBVFS_FCNTL_STATS, &stats)`,
+ * where `stats` is an `idbvfs_stats` struct that will be filled.
+ * @see https://sqlite.org/c3ref/file_control.html
+ */
+#define IDBVFS_FCNTL_STATS 1000
+
+/**
+ * Number of buckets in the latency histograms of `idbvfs_stats`.
+ */
+#define IDBVFS_STATS_LATENCY_BUCKETS 16
+
+/**
+ * I/O statistics of idbvfs files.
+ *
+ * Latency histograms count operations by how long they took:
+ * bucket `i` counts operations that took less than 2^i microseconds,
+ * except for the last one, that counts all slower operations.
+ */
+typedef struct idbvfs_stats {
+	/** Number of pages written by SQLite, counted in idbvfs pages, which may differ in size from SQLite pages. */
+	long long pages_written;
+	/** Number of pages stored in the backing storage, which may be less than `pages_written` since dirty pages are only flushed on sync. */
+	long long pages_flushed;
+	/** Number of reads requested by SQLite. */
+	long long reads;
+	/** Number of writes requested by SQLite. */
+	long long writes;
+	/** Number of syncs requested by SQLite. */
+	long long syncs;
+	/** Number of bytes read by SQLite. */
+	long long bytes_read;
+	/** Number of bytes written by SQLite. */
+	long long bytes_written;
+	/** Number of page reads served by the page cache. */
+	long long cache_hits;
+	/** Number of page reads that had to load pages from the backing storage. */
+	long long cache_misses;
+	/** Number of pages loaded into the page cache ahead of time after sequential reads or when preloading databases. */
+	long long pages_read_ahead;
+	/** Latency histogram of reads. */
+	long long read_latency[IDBVFS_STATS_LATENCY_BUCKETS];
+	/** Latency histogram of writes. */
+	long long write_latency[IDBVFS_STATS_LATENCY_BUCKETS];
+	/** Latency histogram of syncs. */
+	long long sync_latency[IDBVFS_STATS_LATENCY_BUCKETS];
+} idbvfs_stats;
+
 /**
  * Registers idbvfs in SQLite 3.
  *
@@ -46,6 +106,218 @@ extern const char *IDBVFS_NAME;
  */
 int idbvfs_register(int makeDefault);
 
+/**
+ * Policies for persisting synced data to Indexed DB.
+ *
+ * Syncing a database always stores its data in Emscripten's file system,
+ * the policy only controls when the file system gets persisted to Indexed DB.
+ * Persisting is global, so a database with a more eager policy also persists
+ * data synced by the others.
+ *
+ * Policies can be chosen per database with the "sync" URI parameter,
+ * with values "immediate", "debounced" or "manual", and the debounced delay
+ * with the "sync_delay" URI parameter in milliseconds.
+ * The policy is set by the first connection that opens each database.
+ */
+typedef enum idbvfs_sync_policy {
+	/** Persist data every time a database is synced. This is the default. */
+	IDBVFS_SYNC_IMMEDIATE = 0,
+	/** Persist data after a delay, coalescing syncs that happen in the meantime. */
+	IDBVFS_SYNC_DEBOUNCED = 1,
+	/** Only persist data when `idbvfs_flush` is called. */
+	IDBVFS_SYNC_MANUAL = 2,
+} idbvfs_sync_policy;
+
+/**
+ * Sets the sync policy for databases opened without a "sync" URI parameter.
+ *
+ * @param policy  One of the `idbvfs_sync_policy` values.
+ * @param delay_ms  Delay used by `IDBVFS_SYNC_DEBOUNCED`, in milliseconds.
+ * @return `SQLITE_OK` on success, `SQLITE_MISUSE` if the policy or delay are invalid.
+ */
+int idbvfs_set_sync_policy(int policy, int delay_ms);
+
+/**
+ * Persists all synced data to Indexed DB right away.
+ *
+ * Call this after transactions on databases using `IDBVFS_SYNC_MANUAL`,
+ * or to persist pending debounced syncs immediately.
+ *
+ * @return `SQLITE_OK`
+ */
+int idbvfs_flush(void);
+
+/**
+ * Creates a copy-on-write snapshot of an idbvfs database.
+ *
+ * The snapshot is a new database that shares all stored pages with the source
+ * database, so taking it doesn't copy any page. Pages are copied only when either
+ * database writes them for the first time after the snapshot was taken,
+ * which makes snapshots cheap backups, autosave slots or undo checkpoints.
+ * Snapshots can be opened, written, snapshotted and deleted like any other database.
+ * Deleting a database copies the pages its snapshots still share with it into them first.
+ *
+ * Data that connections have not committed is not part of the snapshot,
+ * and databases in WAL mode must be checkpointed with `PRAGMA wal_checkpoint(TRUNCATE)` first.
+ *
+ * @param source  Name of the database to snapshot, as passed to `sqlite3_open_v2`.
+ * @param snapshot  Name of the new database, as passed to `sqlite3_open_v2`.
+ * @return `SQLITE_OK` on success, `SQLITE_NOTFOUND` if the source database doesn't exist,
+ *         `SQLITE_CANTOPEN` if the snapshot database already exists or the source was written by a newer version of idbvfs,
+ *         `SQLITE_BUSY` if a connection is writing to the source database or its WAL file is not empty,
+ *         `SQLITE_MISUSE` if a name is NULL or both names are the same.
+ */
+int idbvfs_snapshot(const char *source, const char *snapshot);
+
+/**
+ * Sets the memory budget shared by the page caches of all idbvfs files.
+ *
+ * When the caches hold more than the budget, clean pages are evicted from
+ * whichever file has the least recently used ones. Pages written by
+ * transactions that were not synced yet are kept until their file syncs.
+ * The default budget is defined by `IDBVFS_CACHE_BUDGET`.
+ *
+ * @param bytes  New budget in bytes, 0 for no limit, or a negative value to only query the budget.
+ * @return The budget before the call.
+ */
+long long idbvfs_cache_budget(long long bytes);
+
+/**
+ * Gets the number of bytes currently held by the page caches of all idbvfs files.
+ */
+long long idbvfs_cache_used(void);
+
+/**
+ * Frees memory by evicting the least recently used clean pages from the idbvfs page caches,
+ * like `sqlite3_release_memory` does for SQLite's own page cache.
+ *
+ * Call it on low memory events, along with `sqlite3_release_memory`.
+ *
+ * @param bytes  Number of bytes to free.
+ * @return Number of bytes actually freed, which may be less than requested.
+ */
+int idbvfs_release_memory(int bytes);
+
+/**
+ * Verifies the checksums of all pages stored for an idbvfs database.
+ *
+ * Only databases created with page checksums (`IDBVFS_CHECKSUMS=1`) or
+ * compression (`IDBVFS_COMPRESS=1`) store checksums. Pages are verified
+ * as they are stored, without decompressing them, so data that is only
+ * in memory and was not synced yet is not checked.
+ *
+ * @param filename  Database file name, as passed to `sqlite3_open_v2`.
+ * @param corrupt_pages  If not NULL, will be filled with the number of corrupt or missing pages.
+ * @return `SQLITE_OK` if all pages are valid, `SQLITE_IOERR_DATA` if any page is corrupt,
+ *         `SQLITE_NOTFOUND` if the database doesn't exist or doesn't store checksums,
+ *         `SQLITE_CANTOPEN` if the database was written by a newer version of idbvfs.
+ */
+int idbvfs_verify_checksums(const char *filename, long long *corrupt_pages);
+
+/**
+ * Gets I/O statistics of idbvfs files.
+ *
+ * Statistics of a file count operations since it was opened by the first
+ * of its currently open connections.
+ * Global statistics count operations on all files opened since idbvfs was registered.
+ *
+ * @param filename  Database file name, as passed to `sqlite3_open_v2`, or NULL for global statistics.
+ * @param stats  Statistics that will be filled.
+ * @return `SQLITE_OK` on success, `SQLITE_NOTFOUND` if the file is not open,
+ *         `SQLITE_MISUSE` if `stats` is NULL.
+ * @see IDBVFS_FCNTL_STATS
+ */
+int idbvfs_get_stats(const char *filename, idbvfs_stats *stats);
+
+/**
+ * Operations recorded by the idbvfs tracer.
+ */
+typedef enum idbvfs_trace_op {
+	/** File opened. `size` holds the open flags. */
+	IDBVFS_TRACE_OPEN = 1,
+	/** File closed. */
+	IDBVFS_TRACE_CLOSE = 2,
+	/** `size` bytes read at `offset`. */
+	IDBVFS_TRACE_READ = 3,
+	/** `size` bytes written at `offset`. */
+	IDBVFS_TRACE_WRITE = 4,
+	/** File truncated to `offset` bytes. */
+	IDBVFS_TRACE_TRUNCATE = 5,
+	/** File synced. `size` holds the sync flags. */
+	IDBVFS_TRACE_SYNC = 6,
+	/** File size queried. `offset` holds the returned size. */
+	IDBVFS_TRACE_FILE_SIZE = 7,
+	/** Batch atomic write started. */
+	IDBVFS_TRACE_BEGIN_ATOMIC_WRITE = 8,
+	/** Batch atomic write committed. */
+	IDBVFS_TRACE_COMMIT_ATOMIC_WRITE = 9,
+	/** Batch atomic write rolled back. */
+	IDBVFS_TRACE_ROLLBACK_ATOMIC_WRITE = 10,
+	/** WAL index region `offset` of `size` bytes mapped. */
+	IDBVFS_TRACE_SHM_MAP = 11,
+	/** WAL index unmapped. `size` holds the delete flag. */
+	IDBVFS_TRACE_SHM_UNMAP = 12,
+	/** Page of `size` bytes at `offset` fetched for memory-mapped I/O. */
+	IDBVFS_TRACE_FETCH = 13,
+	/** Page at `offset` released from memory-mapped I/O. */
+	IDBVFS_TRACE_UNFETCH = 14,
+	/** File deleted. */
+	IDBVFS_TRACE_DELETE = 15,
+	/** File existence checked. `size` holds the access flags and `offset` the result. */
+	IDBVFS_TRACE_ACCESS = 16,
+} idbvfs_trace_op;
+
+/**
+ * Event recorded by the idbvfs tracer.
+ */
+typedef struct idbvfs_trace_event {
+	/** Time when the operation started, in microseconds from an unspecified point in time. */
+	long long timestamp;
+	/** File offset, depending on the operation. */
+	long long offset;
+	/** Size, depending on the operation. */
+	int size;
+	/** Time taken by the operation, in microseconds. */
+	int duration;
+	/** Identifier of the file, as returned by `idbvfs_trace_file_id`. */
+	unsigned int file_id;
+	/** One of the `idbvfs_trace_op` values. */
+	int op;
+	/** SQLite result code of the operation. */
+	int result;
+} idbvfs_trace_event;
+
+/**
+ * Enables or disables tracing of idbvfs operations.
+ *
+ * Traced operations are recorded as `idbvfs_trace_event`s in a ring buffer
+ * of `IDBVFS_TRACE_EVENTS` events, which is allocated the first time tracing is enabled.
+ * Call `idbvfs_trace_drain` periodically to get the recorded events before they are dropped.
+ *
+ * @param enable  Whether tracing is enabled.
+ * @return `SQLITE_OK` on success, `SQLITE_NOMEM` if the ring buffer could not be allocated.
+ */
+int idbvfs_trace_enable(int enable);
+
+/**
+ * Gets the events recorded by the idbvfs tracer, removing them from the ring buffer.
+ *
+ * @param events  Array that will be filled with events, oldest first.
+ * @param max_events  Maximum number of events copied to `events`.
+ * @param dropped_events  If not NULL, will be filled with the number of events
+ *                        overwritten since the last drain because the ring buffer was full.
+ * @return Number of events copied to `events`, or -1 if `events` is NULL.
+ */
+int idbvfs_trace_drain(idbvfs_trace_event *events, int max_events, long long *dropped_events);
+
+/**
+ * Gets the identifier of a file used in `idbvfs_trace_event.file_id`.
+ *
+ * @param filename  File name, as passed to `sqlite3_open_v2`.
+ * @return File identifier, a hash of the file's full path name.
+ */
+unsigned int idbvfs_trace_file_id(const char *filename);
+
 #ifdef __cplusplus
 }
 #endif
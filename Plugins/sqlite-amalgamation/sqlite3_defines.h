@@ -20,3 +20,10 @@
 #define SQLITE_ENABLE_HIDDEN_COLUMNS 1
 // Default temporary storage to in-memory, since TEMP databases are not encrypted
 #define SQLITE_TEMP_STORE 2
+// Emscripten is not in SQLite's list of platforms with memory-mapped I/O.
+// Enable it so that `PRAGMA mmap_size` makes idbvfs serve pages straight from its page cache.
+#if defined(__EMSCRIPTEN__) && !defined(SQLITE_MAX_MMAP_SIZE)
+#define SQLITE_MAX_MMAP_SIZE 0x7fff0000
+#endif
+// Lets SQLite skip the rollback journal on VFSs that support batch atomic writes, like idbvfs
+#define SQLITE_ENABLE_BATCH_ATOMIC_WRITE 1
@@ -0,0 +1,221 @@
+/**
+ * Native benchmark comparing idbvfs with the default VFS.
+ *
+ * Runs insert, update, point read, scan and commit workloads against both
+ * VFSs and reports operations per second and bytes written to the file
+ * system, as counted by Linux in "/proc/self/io".
+ *
+ * Usage: idbvfs-benchmark [-n rows] [-d directory] [-s synchronous] [-v idbvfs|default]
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sqlite3.h"
+#include "idbvfs.h"
+
+struct BenchmarkOptions {
+	int rows = 10000;
+	int rows_per_transaction = 100;
+	std::string directory = "idbvfs-benchmark~";
+	std::string synchronous = "NORMAL";
+	const char *only_vfs = nullptr;
+};
+
+static void check(sqlite3 *db, int result, const char *what) {
+	if (result != SQLITE_OK && result != SQLITE_ROW && result != SQLITE_DONE) {
+		fprintf(stderr, "%s failed: %s\n", what, db ? sqlite3_errmsg(db) : sqlite3_errstr(result));
+		exit(1);
+	}
+}
+
+static void exec(sqlite3 *db, const char *sql) {
+	check(db, sqlite3_exec(db, sql, nullptr, nullptr, nullptr), sql);
+}
+
+static sqlite3_stmt *prepare(sqlite3 *db, const char *sql) {
+	sqlite3_stmt *stmt;
+	check(db, sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr), sql);
+	return stmt;
+}
+
+static void step_and_reset(sqlite3 *db, sqlite3_stmt *stmt) {
+	check(db, sqlite3_step(stmt), sqlite3_sql(stmt));
+	sqlite3_reset(stmt);
+}
+
+/// Bytes passed to write system calls by this process, -1 if unknown.
+static long long bytes_written() {
+	long long value = -1;
+	if (FILE *f = fopen("/proc/self/io", "r")) {
+		char line[128];
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "wchar: %lld", &value) == 1) {
+				break;
+			}
+		}
+		fclose(f);
+	}
+	return value;
+}
+
+static void remove_tree(const std::string& path) {
+	std::string command = "rm -rf '" + path + "'";
+	if (system(command.c_str()) != 0) {
+		fprintf(stderr, "could not remove %s\n", path.c_str());
+	}
+}
+
+class Benchmark {
+public:
+	Benchmark(const BenchmarkOptions& options, const char *vfs_name)
+		: options(options)
+		, vfs_name(vfs_name)
+		, rng(42)
+	{
+		std::string path = options.directory + "/" + vfs_name + ".db";
+		remove_tree(path);
+		remove_tree(path + "-journal");
+		check(nullptr, sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, vfs_name), path.c_str());
+		exec(db, "PRAGMA temp_store=MEMORY");
+		exec(db, ("PRAGMA synchronous=" + options.synchronous).c_str());
+		exec(db, "CREATE TABLE t(id INTEGER PRIMARY KEY, name TEXT, value INTEGER, data BLOB)");
+	}
+
+	~Benchmark() {
+		sqlite3_close(db);
+	}
+
+	void run() {
+		measure("insert", options.rows, [this]() {
+			sqlite3_stmt *stmt = prepare(db, "INSERT INTO t(name, value, data) VALUES(?, ?, randomblob(?))");
+			inTransactions(options.rows, [&](int i) {
+				std::string name = "row " + std::to_string(i);
+				sqlite3_bind_text(stmt, 1, name.c_str(), -1, SQLITE_TRANSIENT);
+				sqlite3_bind_int(stmt, 2, i);
+				sqlite3_bind_int(stmt, 3, 100 + i % 400);
+				step_and_reset(db, stmt);
+			});
+			sqlite3_finalize(stmt);
+		});
+
+		measure("update", options.rows / 2, [this]() {
+			sqlite3_stmt *stmt = prepare(db, "UPDATE t SET value = value + 1, data = randomblob(?) WHERE id = ?");
+			inTransactions(options.rows / 2, [&](int i) {
+				sqlite3_bind_int(stmt, 1, 100 + i % 400);
+				sqlite3_bind_int(stmt, 2, randomRow());
+				step_and_reset(db, stmt);
+			});
+			sqlite3_finalize(stmt);
+		});
+
+		measure("point-read", options.rows, [this]() {
+			sqlite3_stmt *stmt = prepare(db, "SELECT name, value, length(data) FROM t WHERE id = ?");
+			for (int i = 0; i < options.rows; i++) {
+				sqlite3_bind_int(stmt, 1, randomRow());
+				step_and_reset(db, stmt);
+			}
+			sqlite3_finalize(stmt);
+		});
+
+		const int scans = 10;
+		measure("scan", (long long) scans * options.rows, [this, scans]() {
+			for (int i = 0; i < scans; i++) {
+				exec(db, "SELECT sum(value), sum(length(data)) FROM t");
+			}
+		});
+
+		const int commits = std::max(options.rows / 20, 1);
+		measure("commit", commits, [this, commits]() {
+			sqlite3_stmt *stmt = prepare(db, "UPDATE t SET value = value + 1 WHERE id = ?");
+			for (int i = 0; i < commits; i++) {
+				sqlite3_bind_int(stmt, 1, randomRow());
+				step_and_reset(db, stmt);
+			}
+			sqlite3_finalize(stmt);
+		});
+	}
+
+private:
+	const BenchmarkOptions& options;
+	const char *vfs_name;
+	sqlite3 *db = nullptr;
+	std::mt19937 rng;
+
+	int randomRow() {
+		return std::uniform_int_distribution<int>(1, options.rows)(rng);
+	}
+
+	void inTransactions(int count, const std::function<void(int)>& operation) {
+		for (int i = 0; i < count; i++) {
+			if (i % options.rows_per_transaction == 0) {
+				exec(db, "BEGIN");
+			}
+			operation(i);
+			if ((i + 1) % options.rows_per_transaction == 0 || i + 1 == count) {
+				exec(db, "COMMIT");
+			}
+		}
+	}
+
+	void measure(const char *workload, long long operations, const std::function<void()>& body) {
+		long long bytes_before = bytes_written();
+		auto start = std::chrono::steady_clock::now();
+		body();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		long long bytes_after = bytes_written();
+		long long bytes = bytes_before >= 0 && bytes_after >= 0 ? bytes_after - bytes_before : -1;
+		printf("%-12s %-8s %10lld %10.3f %12.0f %14lld\n", workload, vfs_name, operations, seconds, operations / seconds, bytes);
+	}
+};
+
+static void usage(const char *program) {
+	fprintf(stderr, "Usage: %s [-n rows] [-d directory] [-s synchronous] [-v idbvfs|default]\n", program);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	BenchmarkOptions options;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:d:s:v:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				options.rows = std::max(atoi(optarg), 1);
+				break;
+			case 'd':
+				options.directory = optarg;
+				break;
+			case 's':
+				options.synchronous = optarg;
+				break;
+			case 'v':
+				options.only_vfs = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	mkdir(options.directory.c_str(), 0777);
+	idbvfs_register(0);
+	const char *default_vfs_name = sqlite3_vfs_find(nullptr)->zName;
+
+	printf("SQLite %s, %d rows, synchronous=%s\n", sqlite3_libversion(), options.rows, options.synchronous.c_str());
+	printf("%-12s %-8s %10s %10s %12s %14s\n", "workload", "vfs", "ops", "seconds", "ops/s", "bytes written");
+	for (const char *vfs_name : { IDBVFS_NAME, default_vfs_name }) {
+		if (options.only_vfs == nullptr
+			|| strcmp(options.only_vfs, vfs_name) == 0
+			|| (strcmp(options.only_vfs, "default") == 0 && vfs_name == default_vfs_name))
+		{
+			Benchmark(options, vfs_name).run();
+		}
+	}
+	return 0;
+}
@@ -73,14 +73,83 @@ namespace SQLite
         public static extern Result Exec(IntPtr db, [MarshalAs(UnmanagedType.LPStr)] string sql, IntPtr callback, IntPtr userdata, IntPtr errorMessagePtr);
 
 #if UNITY_WEBGL && !UNITY_EDITOR
+        /// <summary>I/O statistics of idbvfs files, with the same layout as <c>idbvfs_stats</c> in idbvfs.h</summary>
+        [StructLayout(LayoutKind.Sequential)]
+        public struct IdbvfsStats
+        {
+            public long PagesWritten;
+            public long PagesFlushed;
+            public long Reads;
+            public long Writes;
+            public long Syncs;
+            public long BytesRead;
+            public long BytesWritten;
+            public long CacheHits;
+            public long CacheMisses;
+            public long PagesReadAhead;
+            [MarshalAs(UnmanagedType.ByValArray, SizeConst = 16)]
+            public long[] ReadLatency;
+            [MarshalAs(UnmanagedType.ByValArray, SizeConst = 16)]
+            public long[] WriteLatency;
+            [MarshalAs(UnmanagedType.ByValArray, SizeConst = 16)]
+            public long[] SyncLatency;
+        }
+
+        /// <summary>Event recorded by the idbvfs tracer, with the same layout as <c>idbvfs_trace_event</c> in idbvfs.h</summary>
+        [StructLayout(LayoutKind.Sequential)]
+        public struct IdbvfsTraceEvent
+        {
+            public long Timestamp;
+            public long Offset;
+            public int Size;
+            public int Duration;
+            public uint FileId;
+            public int Op;
+            public int Result;
+        }
+
         [DllImport(LibraryPath, CallingConvention = CallingConvention.Cdecl)]
         public static extern int idbvfs_register(int makeDefault);
+
+        [DllImport(LibraryPath, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int idbvfs_set_sync_policy(int policy, int delayMilliseconds);
+
+        [DllImport(LibraryPath, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int idbvfs_flush();
+
+        [DllImport(LibraryPath, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int idbvfs_snapshot([MarshalAs(UnmanagedType.LPStr)] string source, [MarshalAs(UnmanagedType.LPStr)] string snapshot);
+
+        [DllImport(LibraryPath, CallingConvention = CallingConvention.Cdecl)]
+        public static extern long idbvfs_cache_budget(long bytes);
+
+        [DllImport(LibraryPath, CallingConvention = CallingConvention.Cdecl)]
+        public static extern long idbvfs_cache_used();
+
+        [DllImport(LibraryPath, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int idbvfs_release_memory(int bytes);
+
+        [DllImport(LibraryPath, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int idbvfs_verify_checksums([MarshalAs(UnmanagedType.LPStr)] string filename, out long corruptPages);
+
+        [DllImport(LibraryPath, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int idbvfs_get_stats([MarshalAs(UnmanagedType.LPStr)] string filename, out IdbvfsStats stats);
+
+        [DllImport(LibraryPath, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int idbvfs_trace_enable(int enable);
+
+        [DllImport(LibraryPath, CallingConvention = CallingConvention.Cdecl)]
+        public static extern int idbvfs_trace_drain([Out] IdbvfsTraceEvent[] events, int maxEvents, out long droppedEvents);
+
+        [DllImport(LibraryPath, CallingConvention = CallingConvention.Cdecl)]
+        public static extern uint idbvfs_trace_file_id([MarshalAs(UnmanagedType.LPStr)] string filename);
 #endif
 
         static SQLite3()
         {
 #if UNITY_WEBGL && !UNITY_EDITOR
             idbvfs_register(1);
+            UnityEngine.Application.lowMemory += () => idbvfs_release_memory(int.MaxValue);
 #endif
         }
     }